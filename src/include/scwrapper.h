@@ -104,6 +104,24 @@ pause(const int ticks)
  return return_value;
 }
 
+/*! Wrapper for the system call that blocks the calling thread until a given
+ *  system time.
+ *  @param time the system time, in ticks, to wake up at. If the time has
+ *         already been reached the call returns ALL_OK at once.
+ *  @param slack the number of ticks the thread may be woken up late. A
+ *         negative slack makes the call return ERROR without blocking.
+ */
+static inline long
+pause_until(long time, long slack)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_PAUSEUNTIL), "D" (time), "S" (slack) :
+                 "cc", "%r11", "%rcx");
+ return return_value;
+}
+
 /*! Wrapper for the system call that returns the current system time 
  *  in ticks.
  */
@@ -256,6 +274,99 @@ receive_long (unsigned long         port,
  return return_value;
 }
 
+/*! Wrapper for the system call that receives a message from a port and
+    gives up after a number of clock ticks. */
+static inline long
+receive_timeout(unsigned long         port,
+                struct message* const message,
+                unsigned long* const  sender,
+                unsigned long         ticks)
+{
+ long return_value;
+ unsigned long message_type;
+ __asm volatile("syscall" :
+                 "=a" (return_value), "=D" (*sender), "=S" (message_type) :
+                 "a" (SYSCALL_RECEIVETIMEOUT), "D" (port), "b" (message),
+                 "d" (ticks):
+                 "cc", "%r11", "%rcx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sends a message to a port and waits
+    for the reply. */
+static inline long
+call(unsigned long         port,
+     struct message* const message,
+     unsigned long* const  replier)
+{
+ long return_value;
+ unsigned long message_type;
+ __asm volatile("syscall" :
+                 "=a" (return_value), "=D" (*replier), "=S" (message_type) :
+                 "a" (SYSCALL_CALL), "D" (port), "S" (SYSCALL_MSG_SHORT),
+                 "b" (message):
+                 "cc", "%r11", "%rcx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that replies to the last caller and receives
+    the next message from a port. */
+static inline long
+reply_wait(unsigned long         port,
+           struct message* const message,
+           unsigned long* const  sender,
+           unsigned long* const  message_type)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value), "=D" (*sender), "=S" (*message_type) :
+                 "a" (SYSCALL_REPLYWAIT), "D" (port), "S" (SYSCALL_MSG_SHORT),
+                 "b" (message):
+                 "cc", "%r11", "%rcx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that returns the address of the time
+    page. */
+static inline const struct time_page*
+gettimepage(void)
+{
+ const struct time_page* return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_GETTIMEPAGE) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Reads the number of nanoseconds since system start from the time page
+    without entering the kernel. */
+static inline unsigned long
+read_time_page(const struct time_page* const time_page)
+{
+ unsigned long sequence;
+ unsigned long nanoseconds;
+
+ do
+ {
+  unsigned int low, high;
+
+  /* Wait for an update in progress to finish. */
+  while (1 & (sequence=time_page->sequence));
+  __asm volatile("" : : : "memory");
+
+  __asm volatile("rdtsc" : "=a" (low), "=d" (high));
+  nanoseconds=time_page->base_nanoseconds+
+   (((((unsigned long) high)<<32 | low)-
+     time_page->base_time_stamp_counter)*time_page->multiplier>>
+    time_page->shift);
+
+  __asm volatile("" : : : "memory");
+ } while (sequence != time_page->sequence);
+
+ return nanoseconds;
+}
+
 /*! Wrapper for the system call that returns the process identity of the
     calling thread. */
 static inline long
@@ -411,4 +522,165 @@ getscancode(void)
  return return_value;
 }
 
+/*! Wrapper for the system call that returns the next keyboard scan code and
+    gives up after a number of clock ticks. */
+static inline long
+getscancode_timeout(unsigned long ticks)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_GETSCANCODETIMEOUT), "D" (ticks) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sets the priority of the calling
+    thread. */
+static inline long
+setpriority(long priority)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SETPRIORITY), "D" (priority) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sets the CPU affinity mask of the
+    calling thread. */
+static inline long
+setaffinity(unsigned long affinity_mask)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SETAFFINITY), "D" (affinity_mask) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that returns the number of times the calling
+    thread has been migrated between CPUs. */
+static inline long
+getmigrations(void)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_GETMIGRATIONS) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sets the weight of the calling
+    process. */
+static inline long
+setweight(long weight)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SETWEIGHT), "D" (weight) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that returns the number of clock ticks a
+    process has been running. */
+static inline long
+getprocessticks(long process)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_GETPROCESSTICKS), "D" (process) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that moves the calling thread into, or out
+    of, the realtime scheduling class. */
+static inline long
+setrealtime(long period, long budget, long deadline)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SETREALTIME), "D" (period), "S" (budget),
+                 "d" (deadline) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that blocks the calling realtime thread until
+    its next period starts. */
+static inline long
+waitnextperiod(void)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_WAITNEXTPERIOD) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that starts or stops the periodic timer of
+    the calling thread. */
+static inline long
+setperiodictimer(long period, long slack)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SETPERIODICTIMER), "D" (period), "S" (slack) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that blocks the calling thread until its
+    periodic timer expires. */
+static inline long
+waitperiodictimer(void)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_WAITPERIODICTIMER) :
+                 "cc", "%rcx", "%r11");
+ return return_value;
+}
+
+/*! Wrapper for the system call that copies the scheduler statistics of a
+    CPU. */
+static inline long
+getschedulerstatistics(long CPU_index,
+                       struct scheduler_statistics* statistics)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_GETSCHEDULERSTATISTICS), "D" (CPU_index),
+                 "S" (statistics) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that copies, or prints, the statistics of a
+    class of kernel locks. */
+static inline long
+getlockstatistics(long lock_class,
+                  struct lock_statistics* statistics)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_GETLOCKSTATISTICS), "D" (lock_class),
+                 "S" (statistics) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
 #endif
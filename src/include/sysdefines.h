@@ -16,6 +16,8 @@
 #define ERROR_ILLEGAL_SYSCALL   (-2)
 /*! Return code when a message is too long. */
 #define ERROR_MESSAGE_TOO_LONG  (-3)
+/*! Return code when a blocking system call times out. */
+#define ERROR_TIMEOUT           (-4)
 /*! Max number of columns in VGA buffer. */
 #define MAX_COLS                (80)
 /*! Max number of columns in VGA buffer. */
@@ -207,9 +209,228 @@
  */
 #define SYSCALL_GETSCANCODE     (27)
 
+/*! Sets the priority of the calling thread. The new priority is passed in
+    the rdi register. Priorities range from 0, the highest priority, to 63,
+    the lowest priority. Threads start with priority 32. A thread becoming
+    ready preempts running threads with a lower priority within one clock
+    tick.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful.
+ */
+#define SYSCALL_SETPRIORITY     (28)
+
+/*! Sets the CPU affinity mask of the calling thread. The mask is passed in
+    the rdi register. Bit i is set if the thread is allowed to run on CPU i.
+    The thread is moved to an allowed CPU if the calling CPU is not allowed.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful. It is an error if the mask does not allow any of the CPUs
+    in the system or if the thread is a realtime thread.
+ */
+#define SYSCALL_SETAFFINITY     (29)
+
+/*! Returns in rax the number of times the calling thread has been moved to
+    another CPU than the one it last ran on. */
+#define SYSCALL_GETMIGRATIONS   (30)
+
+/*! Sets the weight of the process the calling thread belongs to. The weight
+    is passed in the rdi register and must be between 1 and 10000. Processes
+    start with weight 100. Ready threads with the same priority get CPU time
+    in proportion to the weights of their processes, independent of how many
+    threads the processes have.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful.
+ */
+#define SYSCALL_SETWEIGHT       (31)
+
+/*! Returns in rax the number of clock ticks the threads of a process have
+    been running. The index of the process is passed in the rdi register.
+
+    The system call returns an error code in rax if the process index is out
+    of range.
+ */
+#define SYSCALL_GETPROCESSTICKS (32)
+
+/*! Moves the calling thread into the earliest-deadline-first realtime class.
+    The period, in clock ticks, is passed in the rdi register, the budget, the
+    number of clock ticks the thread may run each period, in the rsi register
+    and the deadline, relative to the start of each period, in the rdx
+    register. A deadline of 0 means the end of the period. The budget must
+    not be larger than the deadline and the deadline not larger than the
+    period. A period of 0 moves the thread back to the best-effort class.
+
+    Realtime threads always run before best-effort threads. Among realtime
+    threads the one with the earliest deadline runs. A thread which uses up
+    its budget is stopped until its next period starts. The thread is bound
+    to a CPU where the utilization, budget divided by deadline, of all
+    realtime threads stays below 90%.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the parameters are invalid or the thread cannot be admitted.
+ */
+#define SYSCALL_SETREALTIME     (33)
+
+/*! Ends the current period of the calling realtime thread. The thread blocks
+    until its next period starts.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the thread is not a realtime thread.
+ */
+#define SYSCALL_WAITNEXTPERIOD  (34)
+
+/*! Copies the scheduler statistics of a CPU to a struct
+    scheduler_statistics. The index of the CPU is passed in the rdi register
+    and a pointer to the struct in the rsi register.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the CPU index is out of range.
+ */
+#define SYSCALL_GETSCHEDULERSTATISTICS (35)
+
+/*! Sends a short message to a port and waits for the reply. The handle of
+    the destination port is passed in rdi. A pointer to the message is
+    passed in rbx. The reply is written over the message. The receiver
+    replies with SYSCALL_REPLYWAIT.
+
+    The system call returns ALL_OK in rax if successful or an error code if
+    unsuccessful. Register rdi holds the identity of the process which
+    replied.
+ */
+#define SYSCALL_CALL            (36)
+
+/*! Replies to the thread waiting for the calling thread in SYSCALL_CALL, if
+    there is one, and then receives the next message on a port. The handle
+    of the port is passed in rdi. Register rbx holds a pointer to a buffer
+    holding the reply. The next message is written over the reply.
+
+    The system call returns ALL_OK in rax if successful or an error code if
+    unsuccessful. Register rsi holds the received message type. Register rdi
+    holds the identity of process from which the message was received.
+ */
+#define SYSCALL_REPLYWAIT       (37)
+
+/*! Returns in rax the address of the time page, a struct time_page mapped
+    read-only into every process. The time can be read from the page without
+    entering the kernel. See read_time_page in scwrapper.h. */
+#define SYSCALL_GETTIMEPAGE     (38)
+
+/*! Works as SYSCALL_RECEIVE for short messages but gives up after the number
+    of clock ticks passed in rdx. The handle of the port is passed in rdi and
+    a pointer to the message buffer in rbx. The system call returns
+    ERROR_TIMEOUT in rax if no message arrived in time. A timeout of 0 only
+    takes a message which is already waiting. */
+#define SYSCALL_RECEIVETIMEOUT  (39)
+
+/*! Works as SYSCALL_GETSCANCODE but gives up after the number of clock ticks
+    passed in rdi. The system call returns ERROR_TIMEOUT in rax if no scan
+    code arrived in time. A timeout of 0 only takes a buffered scan code. */
+#define SYSCALL_GETSCANCODETIMEOUT (40)
+
+/*! Blocks the calling thread until the system time reaches the value passed
+    in rdi. The thread may be woken up to the number of clock ticks passed in
+    rsi later. This slack lets the kernel wake up several threads with one
+    timer interrupt. Returns ALL_OK in rax, at once if the time has already
+    been reached, or ERROR if the slack is negative. */
+#define SYSCALL_PAUSEUNTIL      (41)
+
+/*! Starts a periodic timer for the calling thread. The period, in clock
+    ticks, is passed in rdi and the slack, see SYSCALL_PAUSEUNTIL, in rsi.
+    The timer first expires one period from now and then once every period.
+    A period of 0 stops the timer. The slack must be less than the period.
+    Returns ALL_OK if successful or ERROR otherwise. */
+#define SYSCALL_SETPERIODICTIMER (42)
+
+/*! Blocks the calling thread until the periodic timer of the thread expires.
+    The expiry times are counted from the start of the timer so they do not
+    drift with the time the thread runs. Returns at once if the timer has
+    expired since the last call. Returns in rax the number of times the timer
+    has expired since the last call or ERROR if the thread has no periodic
+    timer. */
+#define SYSCALL_WAITPERIODICTIMER (43)
+
+/*! Copies the statistics of the kernel locks of the class passed in rdi to
+    the struct lock_statistics pointed to by rsi. If rsi is 0 the statistics
+    of all lock classes are printed on the console instead. Returns ALL_OK if
+    successful or ERROR if the class is wrong or the kernel is built without
+    LOCKSTAT. */
+#define SYSCALL_GETLOCKSTATISTICS (44)
+
+/* The classes of kernel locks statistics are kept for. All locks of a class
+   share one struct lock_statistics. */
+#define LOCK_CLASS_UNNAMED          (0)
+#define LOCK_CLASS_SCREEN           (1)
+#define LOCK_CLASS_PAGE_FRAME_TABLE (2)
+#define LOCK_CLASS_PROCESS_TABLE    (3)
+#define LOCK_CLASS_CPU_PRIVATE_TABLE (4)
+#define LOCK_CLASS_READY_QUEUE      (5)
+#define LOCK_CLASS_TIMER_WHEEL      (6)
+#define LOCK_CLASS_KEYBOARD         (7)
+#define LOCK_CLASS_PORT             (8)
+#define LOCK_CLASS_PORT_TABLE       (9)
+#define LOCK_CLASS_OBJECT_CACHE     (10)
+#define LOCK_CLASS_MEMORY_BLOCKS    (11)
+#define NUMBER_OF_LOCK_CLASSES      (12)
+
+#define SCHEDULER_HISTOGRAM_BUCKETS (40)
+/*!< The number of buckets in the scheduler histograms. Bucket 0 counts the
+     value 0 and bucket i, for i>0, counts values from 2^(i-1) up to
+     2^i - 1. The last bucket also counts all larger values. */
+
 
 /* Type declarations. */
 
+/*! Describes the scheduler statistics kept by a CPU. */
+struct scheduler_statistics
+{
+ unsigned long context_switches;
+ /*!< The number of times the CPU has started running another thread. */
+ unsigned long wakeup_latency_histogram[SCHEDULER_HISTOGRAM_BUCKETS];
+ /*!< The time, in time stamp counter cycles, from when a thread is made
+      ready until it runs on the CPU. */
+ unsigned long run_queue_length_histogram[SCHEDULER_HISTOGRAM_BUCKETS];
+ /*!< The number of ready threads on the CPU, sampled every clock tick. */
+};
+
+/*! Describes the statistics collected for a class of kernel locks. */
+struct lock_statistics
+{
+ unsigned long acquisitions;
+ /*!< The number of times a lock of the class has been grabbed. */
+ unsigned long contended_acquisitions;
+ /*!< The number of times a CPU had to wait to grab a lock of the class. */
+ unsigned long spin_cycles;
+ /*!< The total number of time stamp counter cycles CPUs have waited for
+      locks of the class. */
+ unsigned long max_hold_cycles;
+ /*!< The longest time, in time stamp counter cycles, a lock of the class
+      has been held with write permissions. */
+};
+
+/*! Describes the time page. The kernel updates the page every clock tick.
+    The time in nanoseconds since system start is base_nanoseconds plus
+    ((time stamp counter - base_time_stamp_counter) * multiplier) >> shift.
+    The fields are consistent if sequence is even and has the same value
+    before and after they are read. */
+struct time_page
+{
+ volatile unsigned long sequence;
+ /*!< Incremented before and after every update. */
+ volatile unsigned long base_time_stamp_counter;
+ /*!< The time stamp counter at the last update. */
+ volatile unsigned long base_nanoseconds;
+ /*!< The number of nanoseconds since system start at the last update. */
+ volatile unsigned long multiplier;
+ /*!< Converts time stamp counter cycles to nanoseconds together with
+      shift. */
+ volatile unsigned long shift;
+ /*!< Converts time stamp counter cycles to nanoseconds together with
+      multiplier. */
+ volatile long          system_time;
+ /*!< The system time in clock ticks, as returned by SYSCALL_TIME. */
+};
+
 /*! Describes a message. */
 struct message
 {
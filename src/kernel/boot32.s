@@ -20,8 +20,8 @@ _start:
  .align 4
 multiboot_header:
  .int    0x1BADB002             # magic word
- .int    1                      # flags
- .int    -(0x1BADB002+1)        # checksum
+ .int    3                      # flags: page align modules, memory map
+ .int    -(0x1BADB002+3)        # checksum
  .int    0
  .int    0
  .int    0
@@ -66,6 +66,55 @@ bss_clear_loop:
  # Set the memory_size variable to the amount of available memory
  # in kilobytes. This value will be adjusted later to bytes.
  movl   %eax,memory_size
+ # Save the address of the multiboot information for the 64-bit code
+ movl   %ebx,multiboot_information
+
+ # If the boot loader gave us a memory map, set memory_size to the end of
+ # the highest block of available memory instead. The holes are dealt with
+ # by the 64-bit code. Memory above 3 Gbytes is not used.
+ testl  $0x40,(%ebx)
+ jz     memory_map_done
+ movl   48(%ebx),%esi       # Address of the first entry
+ movl   44(%ebx),%edi
+ addl   %esi,%edi           # Address of the end of the map
+ xorl   %edx,%edx           # Highest end of available memory in kilobytes
+memory_map_loop:
+ cmpl   %edi,%esi
+ jae    memory_map_end
+ cmpl   $1,20(%esi)         # Only type 1 entries are available memory
+ jne    memory_map_next
+ cmpl   $0,8(%esi)          # Skip blocks starting above 4 Gbytes
+ jne    memory_map_next
+ movl   4(%esi),%eax
+ cmpl   $0xc0000000,%eax    # and blocks starting above 3 Gbytes
+ jae    memory_map_next
+ cmpl   $0,16(%esi)
+ jne    memory_map_clamp
+ addl   12(%esi),%eax       # End of the block
+ jc     memory_map_clamp
+ cmpl   $0xc0000000,%eax
+ jbe    memory_map_compare
+memory_map_clamp:
+ movl   $0xc0000000,%eax
+memory_map_compare:
+ shrl   $10,%eax
+ cmpl   %edx,%eax
+ jbe    memory_map_next
+ movl   %eax,%edx
+memory_map_next:
+ addl   (%esi),%esi         # The size field does not count itself
+ addl   $4,%esi
+ jmp    memory_map_loop
+memory_map_end:
+ testl  %edx,%edx
+ jz     memory_map_done
+ movl   %edx,memory_size
+memory_map_done:
+ # Without a memory map we still cannot use memory above 3 Gbytes
+ cmpl   $3*1024*1024,memory_size
+ jbe    memory_size_done
+ movl   $3*1024*1024,memory_size
+memory_size_done:
 
  # Set a stack so that we can check for CPUID instruction
  movl   $stack_32bit,%esp
@@ -150,6 +199,7 @@ bss_clear_loop:
  movl   $pml4_base,%ebx
  movl   $gdt_32_descriptors,%edx
  movl   memory_size,%edi
+ movl   multiboot_information,%esi
 	
  # We can now do a long jump into the 64-bit code (in boot64.s)
  ljmp   $24,$start_of_64bit_code
@@ -298,3 +348,5 @@ pte_page_15:
 stack_32bit:
 memory_size:
  .int    0
+multiboot_information:
+ .int    0
@@ -48,6 +48,40 @@ bss_clear_loop:
  shl    $10,%rdi
  mov    %rdi,memory_size
 
+ # Save the address of the multiboot information structure
+ mov    %esi,%esi
+ mov    %rsi,multiboot_information
+
+ # boot32.s maps the first 32 Mbytes with 4 kbyte pages. Map the rest of
+ # the memory, up to 3 Gbytes, with 2 Mbyte pages. The page directory of
+ # boot32.s covers the first Gbyte and the two page directories in the bss
+ # cover the next two.
+ movq   $large_page_directories+7,4096+8(%rbx)
+ movq   $large_page_directories+4096+7,4096+16(%rbx)
+ mov    %rdi,%rcx
+ add    $0x200000-1,%rcx
+ shr    $21,%rcx          # Number of 2 Mbyte pages to map
+ mov    $16,%rax          # The first 16 are mapped by boot32.s
+large_page_loop:
+ cmp    %rcx,%rax
+ jae    large_page_done
+ mov    %rax,%rdx
+ shl    $21,%rdx
+ or     $0x87,%rdx        # Present, writable, user and 2 Mbyte page
+ cmp    $512,%rax
+ jae    large_page_upper
+ mov    %rdx,2*4096(%rbx,%rax,8)
+ jmp    large_page_next
+large_page_upper:
+ mov    %rdx,large_page_directories-512*8(,%rax,8)
+large_page_next:
+ inc    %rax
+ jmp    large_page_loop
+large_page_done:
+ # Flush the TLB
+ mov    %cr3,%rax
+ mov    %rax,%cr3
+
  # We do not set a new GDT since all the descriptors we are interested in are
  # there already and there is no problem for us to have it below the 4Gbyte
  # barrier.
@@ -206,3 +240,9 @@ AP_init:
 	
  /* Go wait for work in the idle thread. */
  jmp    return_to_user_mode
+
+ .bss
+ # The page directories mapping the memory between 1 and 3 Gbytes.
+ .align 4096
+large_page_directories:
+ .skip  2*4096
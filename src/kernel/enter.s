@@ -71,7 +71,8 @@ syscall_target:
  call   system_call_handler
 
 return_to_user_mode:
- # Return to user mode.
+ # Return to user mode. Leaving the kernel is a quiescent state, see rcu.c.
+ incq   %gs:32
 
  # Get the index to the thread that should be run
  mov    %gs:24,%eax
@@ -81,25 +82,37 @@ return_to_user_mode:
  test   %eax,%eax
  jns    no_idle
 
- # Set the default kernel page table root pointer.
+ # Set the default kernel page table root pointer. Skip the write, which
+ # flushes the TLB, if the kernel page table root is already loaded.
  mov    kernel_page_table_root,%rbx
+ mov    %cr3,%rcx
+ cmp    %rbx,%rcx
+ je     idle_page_table_loaded
  mov    %rbx,%cr3
+idle_page_table_loaded:
 	
- # The idle thread:
+ # The idle thread. The CPU holds no references while it is halted.
+ movl   $1,%gs:40
  swapgs
  sti    # Enable interrupts
  hlt    # Wait for something to happen
  cli    # Disable interrupts
  swapgs
+ movl   $0,%gs:40
 	
  # Jump back and re-check the ready queue head to see if there are any ready
  # threads that can be run.
  jmp    return_to_user_mode
 
 no_idle:
- # Set a new page table root pointer.
+ # Set a new page table root pointer unless the thread runs in the address
+ # space that is already loaded.
  mov    %gs:8,%rbx
+ mov    %cr3,%rcx
+ cmp    %rbx,%rcx
+ je     page_table_loaded
  mov    %rbx,%cr3
+page_table_loaded:
 
  # mask off everything except the lowest 8 bits
  and    $255,%rax
@@ -255,7 +268,8 @@ interrupt_handler:
  test   %ebp,%ebp
  jns    not_in_kernel
  # The idle thread was interrupted. Just remove a stack frame and call the
- # C code.
+ # C code. The CPU is back in the kernel and may use RCU protected data.
+ movl   $0,%gs:40
 	
  # Check if we got an exception or interrupt
  mov    8(%rsp),%rdi
@@ -9,6 +9,8 @@
 #include "mm.h"
 #include "sync.h"
 #include "network.h"
+#include "timer.h"
+#include "rcu.h"
 
 /* Note: Look in kernel.h for documentation of global variables and
    functions. */
@@ -21,41 +23,78 @@ APIC_id_bit_field;
 unsigned long
 pic_interrupt_bitfield;
 
-volatile unsigned int
-screen_lock=0;
+struct spin_lock
+screen_lock=SPIN_LOCK_INITIALIZER(LOCK_CLASS_SCREEN);
 
-volatile unsigned int
-page_frame_table_lock=0;
+struct spin_lock
+page_frame_table_lock=SPIN_LOCK_INITIALIZER(LOCK_CLASS_PAGE_FRAME_TABLE);
 
 union thread
 thread_table[MAX_NUMBER_OF_THREADS];
 
-volatile unsigned int
-thread_table_lock=0;
-
 struct process
 process_table[MAX_NUMBER_OF_PROCESSES];
 
-volatile unsigned int
-process_table_lock=0;
-
-struct thread_queue
-ready_queue;
-
-volatile unsigned int
-ready_queue_lock=0;
+struct spin_lock
+process_table_lock=SPIN_LOCK_INITIALIZER(LOCK_CLASS_PROCESS_TABLE);
 
 struct CPU_private
 CPU_private_table[MAX_NUMBER_OF_CPUS];
 
+#ifdef LOCKSTAT
+struct lock_statistics
+lock_statistics_table[NUMBER_OF_LOCK_CLASSES];
+
+/*! The names the lock classes are printed with. */
+static const char* const
+lock_class_names[NUMBER_OF_LOCK_CLASSES] =
+{
+ "unnamed",
+ "screen_lock",
+ "page_frame_table_lock",
+ "process_table_lock",
+ "CPU_private_table_lock",
+ "ready_queue_lock",
+ "timer_wheel lock",
+ "keyboard_scancode_buffer_lock",
+ "port lock",
+ "port_table_lock",
+ "object cache lock",
+ "memory_block_lock"
+};
+#endif
+
 unsigned int
 number_of_available_CPUs=0;
 
 volatile unsigned int
 number_of_initialized_CPUs=0;
 
-volatile unsigned int
-CPU_private_table_lock=0;
+struct spin_lock
+CPU_private_table_lock=SPIN_LOCK_INITIALIZER(LOCK_CLASS_CPU_PRIVATE_TABLE);
+
+volatile unsigned long
+idle_CPU_bitmap=0;
+
+unsigned int
+local_timer_counts_per_tick;
+
+unsigned long
+time_stamp_counter_per_tick;
+
+/*! Holds the time page and the page it is shown at in processes. The kernel
+    writes the first page. The kernel never touches the second page. Instead
+    processes get the first page mapped read-only at its address. This way
+    the kernel can update the time page through its own writable mapping
+    while running on the page table of a process. */
+static union
+{
+ struct time_page time_page;
+ char             padding[4096];
+} time_pages[2] __attribute__ ((aligned (4096)));
+
+struct time_page* const
+user_time_page=&time_pages[1].time_page;
 
 unsigned int
 pic_interrupt_map[12];
@@ -72,13 +111,6 @@ const struct executable_image* ELF_images_start;
 
 const char* ELF_images_end;
 
-/* Initialize the timer queue to be empty. */
-int
-timer_queue_head=-1;
-
-volatile unsigned int
-timer_queue_lock=0;
-
 /* Initialize the system time to be 0. */
 volatile long
 system_time=0;
@@ -112,8 +144,8 @@ keyboard_scancode_high_marker = 0;
 struct thread_queue
 keyboard_blocked_threads;
 
-volatile unsigned int
-keyboard_scancode_buffer_lock=0;
+struct spin_lock
+keyboard_scancode_buffer_lock=SPIN_LOCK_INITIALIZER(LOCK_CLASS_KEYBOARD);
 /*!< Spin lock used to ensure mutual exclusion to the keyboard scan code
      buffer. */
 
@@ -173,8 +205,12 @@ prepare_process(const struct Elf64_Ehdr* elf_image,
   /* Build the pdp table. */
   dst = (unsigned long*) (address_to_memory_block+4096);
   *dst = (address_to_memory_block+2*4096) | 7;
-  /* Copy the APIC mapping. */
-  *(dst+3) = *((unsigned long*) (kernel_page_table_root + 4096 + 24));
+  /* Share the page directories mapping the memory between 1 and 3 Gbytes
+     and copy the APIC mapping. */
+  for(i=1; i<4; i++)
+  {
+   *(dst+i) = *((unsigned long*) (kernel_page_table_root + 4096 + i*8));
+  }
 
   /* Build the pd table. */
   dst = (unsigned long*) (address_to_memory_block+2*4096);
@@ -182,6 +218,11 @@ prepare_process(const struct Elf64_Ehdr* elf_image,
   {
    *dst++ = (address_to_memory_block+(3+i)*4096) | 7;
   }
+  /* Copy the 2 Mbyte page mappings of the memory above 32 Mbytes. */
+  for(; i<512; i++)
+  {
+   *dst++ = *((unsigned long*) (kernel_page_table_root + 2*4096 + i*8));
+  }
 
   /* Copy the rest of the kernel page table. */
   dst = (unsigned long*) (address_to_memory_block + 3*4*1024);
@@ -189,6 +230,12 @@ prepare_process(const struct Elf64_Ehdr* elf_image,
   {
    *dst++ = *src++;
   }
+
+  /* Show the time page read-only, present and user accessible, at
+     user_time_page. */
+  dst = (unsigned long*) (address_to_memory_block + 3*4*1024);
+  *(dst + (((unsigned long) user_time_page)>>12)) =
+   ((unsigned long) &time_pages[0]) | 5;
  }
 
  /* Update the start of the block to be after the page table. */
@@ -270,19 +317,20 @@ prepare_process(const struct Elf64_Ehdr* elf_image,
 void
 cleanup_process(const int process)
 {
- register unsigned int i;
+ free_ports_of_process(process);
 
  /* Obtain exclusive access to the page_frame_table. */
  grab_lock_rw(&page_frame_table_lock);
 
- for(i=0; i<memory_pages; i++)
- {
-  if (page_frame_table[i].owner == process)
-  {
-   page_frame_table[i].owner=-1;
-   page_frame_table[i].free_is_allowed=1;
-  }
- }
+ free_frames_of_process(process);
+
+ /* The next process using the entry starts with a fresh share. */
+ grab_lock_rw(&process_table_lock);
+ process_table[process].weight=DEFAULT_PROCESS_WEIGHT;
+ process_table[process].stride=STRIDE_ONE/DEFAULT_PROCESS_WEIGHT;
+ process_table[process].pass=0;
+ process_table[process].consumed_ticks=0;
+ release_lock(&process_table_lock);
 
  CPU_private_table[get_processor_index()].page_table_root =
   kernel_page_table_root;
@@ -293,6 +341,9 @@ void
 send_IPI(register unsigned char const destination_processor_index,
          register unsigned int  const vector)
 {
+ /* Wait until the previous IPI has been delivered. */
+ while (0 != (*(LOCAL_APIC_BASE_ADDRESS + 0x300/4) & 0x1000));
+
  /* Set destination. */
  *(LOCAL_APIC_BASE_ADDRESS + 0x310/4) =
    CPU_private_table[destination_processor_index].local_apic_id<<(56-32);
@@ -326,9 +377,162 @@ initialize_APIC(void)
  *(LOCAL_APIC_BASE_ADDRESS + 0x360/sizeof(unsigned int)) |= 0x10000;
  *(LOCAL_APIC_BASE_ADDRESS + 0x370/sizeof(unsigned int)) |= 0x10000;
 
+ /* Application processors do not get the PIT interrupts. They use their
+    local APIC timer instead. They start out idle, without ticking, waiting
+    for a wakeup IPI. */
+ if (0 != get_processor_index())
+ {
+  CPU_private_table[get_processor_index()].local_timer_is_periodic = 0;
+  lock_or(&idle_CPU_bitmap, 1UL<<get_processor_index());
+ }
+
  number_of_initialized_CPUs++;
 }
 
+void
+stop_local_timer(void)
+{
+ /* Mask the timer and stop it by writing a zero initial count. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x320/sizeof(unsigned int)) =
+  LOCAL_TIMER_VECTOR | 0x10000;
+ *(LOCAL_APIC_BASE_ADDRESS + 0x380/sizeof(unsigned int)) = 0;
+}
+
+void
+start_periodic_local_timer(void)
+{
+ /* Divide the bus clock by 16. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x3e0/sizeof(unsigned int)) = 0x3;
+ /* Unmasked, periodic mode. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x320/sizeof(unsigned int)) =
+  LOCAL_TIMER_VECTOR | 0x20000;
+ /* Writing the initial count starts the timer. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x380/sizeof(unsigned int)) =
+  local_timer_counts_per_tick;
+}
+
+void
+start_one_shot_local_timer(const register unsigned int ticks)
+{
+ register unsigned long counts =
+  ((unsigned long) ticks)*local_timer_counts_per_tick;
+
+ /* Sleep as long as the timer can count if the interval is too long. */
+ if (counts > 0xffffffff)
+  counts = 0xffffffff;
+
+ /* Divide the bus clock by 16. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x3e0/sizeof(unsigned int)) = 0x3;
+ /* Unmasked, one-shot mode. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x320/sizeof(unsigned int)) =
+  LOCAL_TIMER_VECTOR;
+ /* Writing the initial count starts the timer. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x380/sizeof(unsigned int)) = counts;
+}
+
+/*! Reads the current count of channel 0 of the PIT. */
+static unsigned int
+read_PIT_count(void)
+{
+ register unsigned int low, high;
+
+ /* Latch the count and read it, low byte first. */
+ outb(0x43, 0x00);
+ low = (unsigned char) inb(0x40);
+ high = (unsigned char) inb(0x40);
+
+ return (high << 8) | low;
+}
+
+/*! Busy waits until channel 0 of the PIT reloads its count, i.e., until the
+    start of the next clock tick. The PIT must be in rate generator mode. */
+static void
+wait_for_PIT_reload(void)
+{
+ register unsigned int previous_count = read_PIT_count();
+
+ while (1)
+ {
+  register unsigned int const count = read_PIT_count();
+
+  /* The count only goes up when it is reloaded. */
+  if (count > previous_count)
+   return;
+
+  previous_count = count;
+ }
+}
+
+/*! Measures the number of time stamp counter cycles during one clock tick
+    and sets up the time page. */
+static void
+calibrate_time_stamp_counter(void)
+{
+ register unsigned long start;
+ register int           i;
+
+ wait_for_PIT_reload();
+ start = read_time_stamp_counter();
+
+ for(i=0; i<TIME_STAMP_COUNTER_CALIBRATION_TICKS; i++)
+  wait_for_PIT_reload();
+
+ time_stamp_counter_per_tick = (read_time_stamp_counter() - start)/
+                               TIME_STAMP_COUNTER_CALIBRATION_TICKS;
+
+ time_pages[0].time_page.sequence = 0;
+ time_pages[0].time_page.shift = 32;
+ time_pages[0].time_page.multiplier =
+  (((unsigned long) NANOSECONDS_PER_CLOCK_TICK)<<32)/
+  time_stamp_counter_per_tick;
+ time_pages[0].time_page.base_nanoseconds = 0;
+ time_pages[0].time_page.system_time = system_time;
+ time_pages[0].time_page.base_time_stamp_counter = read_time_stamp_counter();
+}
+
+/*! Brings the time page up to date. Only called by the BSP. */
+static void
+update_time_page(void)
+{
+ register struct time_page* const time_page = &time_pages[0].time_page;
+ register const unsigned long time_stamp_counter = read_time_stamp_counter();
+
+ /* Readers retry while the sequence number is odd or has changed. Stores
+    are not reordered on x86 so only the compiler has to be held back. */
+ time_page->sequence++;
+ __asm volatile("" : : : "memory");
+
+ time_page->base_nanoseconds +=
+  ((time_stamp_counter - time_page->base_time_stamp_counter)*
+   time_page->multiplier) >> time_page->shift;
+ time_page->base_time_stamp_counter = time_stamp_counter;
+ time_page->system_time = system_time;
+
+ __asm volatile("" : : : "memory");
+ time_page->sequence++;
+}
+
+/*! Measures the number of counts the local APIC timer counts down during one
+    clock tick. All local APIC timers are assumed to run at the same
+    frequency. */
+static void
+calibrate_local_timer(void)
+{
+ wait_for_PIT_reload();
+
+ /* Divide the bus clock by 16 and start counting down from the top. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x3e0/sizeof(unsigned int)) = 0x3;
+ *(LOCAL_APIC_BASE_ADDRESS + 0x380/sizeof(unsigned int)) = 0xffffffff;
+
+ wait_for_PIT_reload();
+
+ local_timer_counts_per_tick = 0xffffffff -
+  *(LOCAL_APIC_BASE_ADDRESS + 0x390/sizeof(unsigned int));
+
+ /* Stop the timer. */
+ *(LOCAL_APIC_BASE_ADDRESS + 0x380/sizeof(unsigned int)) = 0;
+}
+
 static unsigned int
 read_io_apic_register(register unsigned int const register_number)
 {
@@ -357,6 +561,21 @@ initialize(void)
   thread_table[i].data.owner=-1; /* -1 is an illegal process_table index.
                                      We use that to show that the thread
                                      is dormant. */
+  /* New threads start at the default priority without any demotion. */
+  thread_table[i].data.priority=DEFAULT_PRIORITY;
+  thread_table[i].data.feedback_level=0;
+  /* New threads may run anywhere and have not run anywhere yet. */
+  thread_table[i].data.last_CPU=-1;
+  thread_table[i].data.affinity_mask=-1;
+  thread_table[i].data.migrations=0;
+  /* New threads are in the best-effort class. */
+  thread_table[i].data.realtime_period=0;
+  thread_table[i].data.ready_timestamp=0;
+  thread_table[i].data.reply_thread=-1;
+  thread_table[i].data.waiting_for_reply=0;
+  thread_table[i].data.timer_slot=-1;
+  thread_table[i].data.timeout_state=TIMEOUT_NONE;
+  thread_table[i].data.periodic_timer_period=0;
  }
 
  /* Loop over all processes in the thread table and mark them as not
@@ -365,6 +584,15 @@ initialize(void)
  {
   process_table[i].threads=0;    /* No executing process has less than 1
                                     thread. */
+  process_table[i].weight=DEFAULT_PROCESS_WEIGHT;
+  process_table[i].stride=STRIDE_ONE/DEFAULT_PROCESS_WEIGHT;
+  process_table[i].pass=0;
+  process_table[i].consumed_ticks=0;
+  /* No process owns any memory yet. */
+  process_table[i].first_memory_block=-1;
+  process_table[i].owned_frames=0;
+  initialize_spin_lock(&process_table[i].memory_block_lock,
+                       LOCK_CLASS_MEMORY_BLOCKS);
  }
 
  /* Initialize the CPU_private_table. */
@@ -377,6 +605,25 @@ initialize(void)
   CPU_private_table[i].thread_index = -1;
   CPU_private_table[i].CPU_index = i;
   CPU_private_table[i].ticks_left_of_time_slice = 1;
+  /* Initialize the per-CPU ready queues. */
+  for(j=0; j<NUMBER_OF_PRIORITY_LEVELS; j++)
+   thread_queue_init(&CPU_private_table[i].ready_queue[j]);
+  CPU_private_table[i].ready_queue_bitmap = 0;
+  initialize_spin_lock(&CPU_private_table[i].ready_queue_lock,
+                       LOCK_CLASS_READY_QUEUE);
+  CPU_private_table[i].used_mcs_nodes = 0;
+  CPU_private_table[i].ready_queue_length = 0;
+  CPU_private_table[i].ticks_until_priority_boost = 0;
+  CPU_private_table[i].local_timer_is_periodic = 0;
+  thread_queue_init(&CPU_private_table[i].realtime_queue);
+  CPU_private_table[i].realtime_utilization = 0;
+  CPU_private_table[i].handoff_thread_index = -1;
+  CPU_private_table[i].statistics.context_switches = 0;
+  for(j=0; j<SCHEDULER_HISTOGRAM_BUCKETS; j++)
+  {
+   CPU_private_table[i].statistics.wakeup_latency_histogram[j] = 0;
+   CPU_private_table[i].statistics.run_queue_length_histogram[j] = 0;
+  }
  }
 
  /* Set up the PIC interrupt map. */
@@ -388,46 +635,12 @@ initialize(void)
  for(i=0; i<64; i++)
   if (APIC_id_bit_field & (1 << i))
    CPU_private_table[j++].local_apic_id=i;
- /* Initialize the ready queue. */
- thread_queue_init(&ready_queue);
 
  /* Initialize the list of blocked threads waiting for the keyboard. */
  thread_queue_init(&keyboard_blocked_threads);
 
- /* Calculate the number of pages. */
- memory_pages = memory_size/(4*1024);
-
- if (memory_pages > MAX_NUMBER_OF_FRAMES)
-  memory_pages = MAX_NUMBER_OF_FRAMES;
-
- {
-  /* Calculate the number of frames occupied by the kernel and executable 
-     images. */
-  const register int k = first_available_memory_byte/(4*1024);
-
-  /* Mark the pages that are used by the kernel or executable images as taken
-    by the kernel (-2 in the owner field). */
-  for(i=0; i<k; i++)
-  {
-   page_frame_table[i].owner = -2;
-   page_frame_table[i].free_is_allowed = 0;
-  }
-
-  /* Loop over all the rest page frames and mark them as free (-1 in owner
-     field). */
-  for(i=k; i<memory_pages; i++)
-  {
-   page_frame_table[i].owner = -1;
-   page_frame_table[i].free_is_allowed = 1;
-  }
-
-  /* Mark any unusable pages as taken by the kernel. */
-  for(i=memory_pages; i<MAX_NUMBER_OF_FRAMES; i++)
-  {
-   page_frame_table[i].owner = -2;
-   page_frame_table[i].free_is_allowed = 0;
-  }
- }
+ /* Set up the page frame table from the memory map. */
+ initialize_page_frames();
 
  /* Go through the linked list of executable images and verify that they
     are correct. At the same time build the executable_table. */
@@ -605,6 +818,7 @@ initialize(void)
 
  initialize_memory_protection();
  initialize_ports();
+ initialize_timer_wheels();
  initialize_thread_synchronization();
  initialize_ne2k();
  initialize_network();
@@ -664,8 +878,10 @@ initialize(void)
  outb(0x21, 0xff);
  outb(0xA1, 0xff);
 
- /* Set up the timer hardware to generate interrupts 200 times a second. */
- outb(0x43, 0x36);
+ /* Set up the timer hardware to generate interrupts 200 times a second. The
+    rate generator mode is used so that the count can be used to calibrate
+    the local APIC timers. */
+ outb(0x43, 0x34);
  outb(0x40, 78);
  outb(0x40, 23);
 
@@ -691,6 +907,11 @@ initialize(void)
   initialize_APIC();
   number_of_initialized_CPUs = 1;
 
+  /* The application processors need to know the speed of their local APIC
+     timers when they initialize their APICs. */
+  calibrate_local_timer();
+  calibrate_time_stamp_counter();
+
   kprints("BSP initialized.\n");
 
   for(processor_index = 1;
@@ -854,8 +1075,11 @@ initialize(void)
 
  {
   register unsigned int timer_gsi = pic_interrupt_map[0];
-  /* Send timer interrupts to all cpus. */
-  write_io_apic_register(0x11 + timer_gsi*2, 0xff000000);
+  /* Send timer interrupts to the BSP. It maintains the system time. The
+     application processors use their local APIC timers and only tick when
+     they have threads to run. */
+  write_io_apic_register(0x11 + timer_gsi*2,
+   CPU_private_table[0].local_apic_id << 24);
   write_io_apic_register(0x10 + timer_gsi*2, 0x00000020);
  }
 
@@ -910,7 +1134,6 @@ system_call_handler(void)
  {
   case SYSCALL_PAUSE:
   {
-   register int  tmp_thread_index;
    unsigned long timer_ticks=SYSCALL_ARGUMENTS.rdi;
 
    /* Set the return value before doing anything else. We will switch to a new
@@ -923,103 +1146,32 @@ system_call_handler(void)
     break;
    }
 
-   /* Get the current thread. */
-   tmp_thread_index=get_current_thread();
-
    /* Force a re-schedule. */
    schedule=1;
 
-   /* And insert the thread into the timer queue. */
-
-   /* The timer queue is a linked list of threads. The head (first entry)
-      (thread) in the list has a list_data field that holds the number of
-      ticks to wait before the thread is made ready. The next entries (threads)
-      has a list_data field that holds the number of ticks to wait after the
-      previous thread is made ready. This is called to use a delta-time and
-      makes the code to test if threads should be made ready very quick. It
-      also, unfortunately, makes the code that insert code into the queue
-      rather complex. */
-
-   /* Grab the locks we need. */
-   grab_lock_rw(&timer_queue_lock);
-
-   /* If the queue is empty put the thread as only entry. */
-   if (-1 == timer_queue_head)
-   {
-    thread_table[tmp_thread_index].data.next=-1;
-    thread_table[tmp_thread_index].data.list_data=timer_ticks;
-    timer_queue_head=tmp_thread_index;
-   }
-   else
-   {
-    /* Check if the thread should be made ready before the head of the
-       previous timer queue. */
-    register int curr_timer_queue_entry=timer_queue_head;
-
-    if (thread_table[curr_timer_queue_entry].data.list_data>timer_ticks)
-    {
-     /* If so set it up as the head in the new timer queue. */
-
-     thread_table[curr_timer_queue_entry].data.list_data-=timer_ticks;
-     thread_table[tmp_thread_index].data.next=curr_timer_queue_entry;
-     thread_table[tmp_thread_index].data.list_data=timer_ticks;
-     timer_queue_head=tmp_thread_index;
-    }
-    else
-    {
-     register int prev_timer_queue_entry = curr_timer_queue_entry;
-
-     /* Search until the end of the queue or until we found the right spot. */
-     while((-1 != thread_table[curr_timer_queue_entry].data.next) &&
-           (timer_ticks>=thread_table[curr_timer_queue_entry].data.list_data))
-     {
-      timer_ticks-=thread_table[curr_timer_queue_entry].data.list_data;
-      prev_timer_queue_entry=curr_timer_queue_entry;
-      curr_timer_queue_entry=thread_table[curr_timer_queue_entry].data.next;
-     }
-
-
-     if (timer_ticks>=thread_table[curr_timer_queue_entry].data.list_data)
-     {
-      /* Insert the thread into the queue after the existing entry. */
-      thread_table[tmp_thread_index].data.next=
-       thread_table[curr_timer_queue_entry].data.next;
-      thread_table[curr_timer_queue_entry].data.next=tmp_thread_index;
-      thread_table[tmp_thread_index].data.list_data=timer_ticks-
-       thread_table[curr_timer_queue_entry].data.list_data;
-     }
-     else
-     {
-      /* Insert the thread into the queue before the existing entry. */
-      thread_table[tmp_thread_index].data.next=
-       curr_timer_queue_entry;
-      thread_table[prev_timer_queue_entry].data.next=tmp_thread_index;
-      thread_table[tmp_thread_index].data.list_data=timer_ticks;
-      thread_table[curr_timer_queue_entry].data.list_data-=timer_ticks;
-     }
-    }
-   }
-
-   /* We are done accessing the timer queue so we can release the lock. */
-   release_lock(&timer_queue_lock);
+   /* And insert the thread into the timer wheel. */
+   timer_wheel_insert(get_current_thread(), timer_ticks);
    break;
   }
 
   case SYSCALL_TIME:
   {
-   /* Returns the current system time to the program. */
-
-   /* Grabs the lock with read permissions so that the time will not change
-      when reading it. */
-   grab_lock_r(&timer_queue_lock);
+   /* Returns the current system time to the program. The system time is
+      only written by the BSP and is read with a single load. */
    SYSCALL_ARGUMENTS.rax=system_time;
-   release_lock(&timer_queue_lock);
+   break;
+  }
+
+  case SYSCALL_GETTIMEPAGE:
+  {
+   SYSCALL_ARGUMENTS.rax=(unsigned long) user_time_page;
    break;
   }
 
   case SYSCALL_FREE:
   {
-   SYSCALL_ARGUMENTS.rax=kfree(SYSCALL_ARGUMENTS.rdi);
+   SYSCALL_ARGUMENTS.rax=kfree(SYSCALL_ARGUMENTS.rdi,
+                               thread_table[get_current_thread()].data.owner);
    break;
   }
 
@@ -1085,14 +1237,22 @@ system_call_handler(void)
   
   case SYSCALL_GETPID:
   {
-   grab_lock_r(&thread_table_lock);
+   /* The owner of the running thread cannot change under it. */
+   rcu_read_lock();
    SYSCALL_ARGUMENTS.rax = thread_table[get_current_thread()].data.owner;
-   release_lock(&thread_table_lock);
+   rcu_read_unlock();
   break;
   }
 
   case SYSCALL_GETSCANCODE:
+  case SYSCALL_GETSCANCODETIMEOUT:
   {
+   /* SYSCALL_GETSCANCODE waits forever. So do timeouts which do not fit in
+      a long. */
+   register const long timeout_ticks=
+    ((SYSCALL_GETSCANCODE == SYSCALL_ARGUMENTS.rax) ||
+     (((long) SYSCALL_ARGUMENTS.rdi) < 0)) ? -1 : SYSCALL_ARGUMENTS.rdi;
+
    /* Grab spin lock. */
    grab_lock_rw(&keyboard_scancode_buffer_lock);
 
@@ -1110,10 +1270,21 @@ system_call_handler(void)
 
     /* Set the default return value to be an error. */
     SYSCALL_ARGUMENTS.rax=ERROR;
-    current_thread_index=get_current_thread();
-    /* Tell the scheduler that it will have to reschedule. */
-    schedule=1;
-    thread_queue_enqueue(&keyboard_blocked_threads, current_thread_index);
+
+    if (0 == timeout_ticks)
+    {
+     SYSCALL_ARGUMENTS.rax=ERROR_TIMEOUT;
+    }
+    else
+    {
+     current_thread_index=get_current_thread();
+     /* Tell the scheduler that it will have to reschedule. */
+     schedule=1;
+     if (0 < timeout_ticks)
+      timer_wheel_arm_timeout(current_thread_index, timeout_ticks,
+                              TIMEOUT_OBJECT_KEYBOARD);
+     thread_queue_enqueue(&keyboard_blocked_threads, current_thread_index);
+    }
    }
 
    /* Release spin lock. */
@@ -1138,59 +1309,65 @@ timer_interrupt_handler(void)
  /*!< Interrupt hander code may set this variable to 0. The variable is
       used as input to the scheduler to indicate if the interrupt code has
       updated scheduling data structures. */
- /* Only the BSP should maintain the timer queue and system time. */
+ /* Only the BSP should maintain the system time. */
  if (0 == get_processor_index())
  {
-  /* Grab the locks so that we can access the data structures freely. */
-  grab_lock_rw(&timer_queue_lock);
-
-  /* Increment system time. */
   system_time++;
+  update_time_page();
+ }
 
-  /* Check if there are any thread that we should make ready.
-     First check if there are any threads at all in the timer
-     queue. */
-  if (-1 != timer_queue_head)
-  {
-   /* Then decrement the list_data in the head. */
-   thread_table[timer_queue_head].data.list_data-=1;
-
-   /* Then remove all elements including with a list_data equal to zero
-      and insert them into the ready queue. These are the threads that
-      should be woken up. */
-   while((-1 != timer_queue_head) &&
-         /* We remove all entries less than or equal to 0. Equality should be
-            enough but checking with less than or equal may hide the symptoms
-            of some bugs and make the system more stable. */
-         (thread_table[timer_queue_head].data.list_data<=0))
-   {
-    register int tmp_thread_index=timer_queue_head;
-    /* Remove the head element.*/
-    timer_queue_head=thread_table[tmp_thread_index].data.next;
+ /* Every CPU wakes up the threads sleeping in its own timer wheel and runs
+    its own RCU callbacks. */
+ timer_wheel_tick();
+ rcu_tick();
+ scheduler_called_from_timer_interrupt_handler(thread_changed);
 
-    /* Let the woken thread run if the CPU is not running any thread. */
-    if (-1 == get_current_thread())
-    {
-     CPU_private_table[get_processor_index()].thread_index = tmp_thread_index;
-     thread_changed=1;
-     CPU_private_table[get_processor_index()].page_table_root =
-      process_table[thread_table[tmp_thread_index].data.owner].
-       page_table_root;
-    }
-    else
-    {
-     /* Or insert it into the ready queue. */
-     grab_lock_rw(&ready_queue_lock);
-     thread_queue_enqueue(&ready_queue, tmp_thread_index);
-     release_lock(&ready_queue_lock);
-    }
-   }
-  }
-  /* Done updating the structures. */
-  release_lock(&timer_queue_lock);
+}
+
+void
+print_lock_statistics(void)
+{
+#ifdef LOCKSTAT
+ register int i;
+
+ kprints("Lock statistics: acquisitions, contended, spin cycles, "
+         "max hold cycles.\n");
+
+ for(i=0; i<NUMBER_OF_LOCK_CLASSES; i++)
+ {
+  kprints(lock_class_names[i]);
+  kprints(": ");
+  kprinthex(lock_statistics_table[i].acquisitions);
+  kprints(" ");
+  kprinthex(lock_statistics_table[i].contended_acquisitions);
+  kprints(" ");
+  kprinthex(lock_statistics_table[i].spin_cycles);
+  kprints(" ");
+  kprinthex(lock_statistics_table[i].max_hold_cycles);
+  kprints("\n");
  }
- scheduler_called_from_timer_interrupt_handler(thread_changed);
+#endif
+}
+
+void
+timeout_expired(const int thread_index)
+{
+ register const int timeout_object=
+  thread_table[thread_index].data.timeout_object;
 
+ if (TIMEOUT_OBJECT_KEYBOARD == timeout_object)
+ {
+  grab_lock_rw(&keyboard_scancode_buffer_lock);
+  thread_queue_remove(&keyboard_blocked_threads, thread_index);
+  release_lock(&keyboard_scancode_buffer_lock);
+ }
+ else
+  ipc_cancel_receive(thread_index, timeout_object);
+
+ thread_table[thread_index].data.registers.integer_registers.rax=
+  ERROR_TIMEOUT;
+ thread_table[thread_index].data.timeout_state=TIMEOUT_NONE;
+ make_thread_ready(thread_index);
 }
 
 /*! Keyboard interrupt handler. */
@@ -1202,12 +1379,19 @@ keyboard_interrupt_handler(void)
  if ((status_byte&1)==1)
  {
   register unsigned char data=inb(0x60);
+  register int           blocked_thread_index;
 
   /* Grab the buffer lock. */
   grab_lock_rw(&keyboard_scancode_buffer_lock);
 
-  /* Is a thread waiting for data? */
-  if (thread_queue_is_empty(&keyboard_blocked_threads))
+  /* Is a thread waiting for data? Threads whose timeout has won are
+     skipped. They are left to timeout_expired. */
+  while((-1 != (blocked_thread_index=
+                thread_queue_head(&keyboard_blocked_threads))) &&
+        !timer_wheel_claim_waiter(blocked_thread_index))
+   thread_queue_dequeue(&keyboard_blocked_threads);
+
+  if (-1 == blocked_thread_index)
   {
    /* Store scan code in the buffer if there is space in the buffer. */
    register int buffer_size=keyboard_scancode_high_marker-
@@ -1221,27 +1405,13 @@ keyboard_interrupt_handler(void)
   else
   {
    /* Let the first blocked thread get the scan code. */
-   register int blocked_thread_index=
-    thread_queue_dequeue(&keyboard_blocked_threads);
+   thread_queue_dequeue(&keyboard_blocked_threads);
    thread_table[blocked_thread_index].data.registers.integer_registers.rax=
     data;
 
-   /* Let the woken thread run if the CPU is not running any thread. */
-   if (-1 == get_current_thread())
-   {
-    CPU_private_table[get_processor_index()].thread_index = blocked_thread_index;
-
-    CPU_private_table[get_processor_index()].page_table_root =
-     process_table[thread_table[blocked_thread_index].data.owner].
-      page_table_root;
-   }
-   else
-   {
-    /* Or insert it into the ready queue. */
-    grab_lock_rw(&ready_queue_lock);
-    thread_queue_enqueue(&ready_queue, blocked_thread_index);
-    release_lock(&ready_queue_lock);
-   }
+   /* Insert it into a ready queue. The thread is dispatched at once if it
+      ends up on this CPU and the CPU is not running any thread. */
+   make_thread_ready(blocked_thread_index);
   }
 
   /* Release buffer lock. */
@@ -1267,6 +1437,13 @@ interrupt_dispatcher(const unsigned long interrupt_number)
    break;
   }
 
+  case LOCAL_TIMER_VECTOR:
+  {
+   /* The application processors tick with their local APIC timers. */
+   timer_interrupt_handler();
+   break;
+  }
+
   case 35:
   {
    ne2k_interrupt_handler();
@@ -1281,9 +1458,10 @@ interrupt_dispatcher(const unsigned long interrupt_number)
    break;
   }
 
-  case 240:
+  case WAKEUP_IPI_VECTOR:
   {
-   /* Dummy IPI handler. */
+   /* Another CPU has made a thread ready for this CPU. */
+   scheduler_called_from_wakeup_IPI_handler();
    break;
   }
 
@@ -28,6 +28,21 @@
 /*!< Size of the thread_table. */
 #define MAX_NUMBER_OF_CPUS      (16)
 /*!< Size of the cpu_table and the maximal number of CPUs in the system. */
+#define NUMBER_OF_PRIORITY_LEVELS (64)
+/*!< The number of priority levels. Level 0 is the highest priority. There
+     is one ready queue per level and CPU. The number must not be larger than
+     the number of bits in the ready queue bitmap. */
+#define DEFAULT_PRIORITY        (32)
+/*!< The priority new threads get. */
+#define NUMBER_OF_FEEDBACK_LEVELS (4)
+/*!< The number of levels a thread can be demoted below its priority by the
+     multi-level feedback queue scheduler. */
+#define REALTIME_UTILIZATION_SCALE (1UL<<16)
+/*!< The fixed point scale used for CPU utilization. A utilization of
+     REALTIME_UTILIZATION_SCALE means all of the time of a CPU. */
+#define MAX_REALTIME_UTILIZATION (REALTIME_UTILIZATION_SCALE*9/10)
+/*!< The part of the time of a CPU that can be reserved by realtime
+     threads. The rest is left for best-effort threads. */
 #define MAX_GLOBAl_SYSTEM_INTERRUPTS (64)
 /*!< The number of ACPI Global System Interrupts supported by the kernel. The
      range of interrupts is between 0..MAX_GLOBAL_SYSTEM_INTERRUPTS-1. */
@@ -35,9 +50,30 @@
 /*!< The base address for the IO APIC. */
 #define LOCAL_APIC_BASE_ADDRESS ((volatile unsigned int* const) 0xfee00000UL)
 /*!< The base address for the local APIC. */
+#define LOCAL_TIMER_VECTOR      (48)
+/*!< The interrupt vector used by the local APIC timers. */
+#define NANOSECONDS_PER_CLOCK_TICK (5000075)
+/*!< The length of a clock tick. The PIT divides its 1193182 Hz clock by
+     5966. */
+#define TIME_STAMP_COUNTER_CALIBRATION_TICKS (10)
+/*!< The number of clock ticks the time stamp counter is measured over at
+     boot. */
+#define WAKEUP_IPI_VECTOR       (240)
+/*!< The interrupt vector used to wake up idle CPUs when there is work for
+     them. */
 
 /* Type declarations */
 
+struct thread_queue
+{
+ int head;  /*!< The index to the head of the thread queue.
+                 Is -1 if queue is empty. */
+ int tail;  /*!< The index to the tail of the thread queue.
+                 Is -1 if queue is empty. */
+};
+/*!< Describes a queue of threads. The operations on thread queues are
+     declared in threadqueue.h. */
+
 /*! Defines an execution context. */
 struct context
 {
@@ -98,10 +134,126 @@ union thread
                                      resides in. In the timer queue this
                                      variable is either an absolute time or a
                                      delta time.*/
+  int            priority;      /*!< The fixed priority of the thread.
+                                     0 is the highest priority. */
+  int            feedback_level; /*!< The number of levels the multi-level
+                                     feedback queue scheduler has demoted
+                                     the thread below its priority. */
+  int            last_CPU;      /*!< Index of the CPU the thread last ran
+                                     on or -1 if the thread has not run. The
+                                     thread is preferably made ready on this
+                                     CPU as its caches are likely to still
+                                     hold the thread's working set. */
+  unsigned long  affinity_mask; /*!< Bit i is set iff the thread is allowed
+                                     to run on the CPU with index i. */
+  unsigned long  saved_affinity_mask; /*!< The affinity_mask of a realtime
+                                     thread before it was admitted. It is
+                                     restored when the thread leaves the
+                                     realtime class. */
+  unsigned long  migrations;    /*!< The number of times the thread has been
+                                     dispatched on another CPU than the one
+                                     it last ran on. */
+  long           realtime_period; /*!< The period, in clock ticks, of a
+                                     realtime thread. Is 0 if the thread is
+                                     in the best-effort class. */
+  long           realtime_budget; /*!< The number of clock ticks a realtime
+                                     thread may run each period. */
+  long           realtime_deadline; /*!< The deadline of a realtime thread
+                                     relative to the start of each period. */
+  long           absolute_deadline; /*!< The system time at which the
+                                     current period of a realtime thread must
+                                     be done. Realtime threads are dispatched
+                                     in order of this deadline. */
+  long           budget_left;   /*!< The number of clock ticks a realtime
+                                     thread may still run in the current
+                                     period. */
+  long           next_release;  /*!< The system time at which the next period
+                                     of a realtime thread starts. */
+  unsigned long  ready_pass;    /*!< The pass of the process of the thread
+                                     when the thread was put in a ready
+                                     queue. The ready queues are sorted by
+                                     it. */
+  unsigned long  ready_timestamp; /*!< The time stamp counter when the
+                                     thread was last made ready. Is 0 once
+                                     the thread has been dispatched. */
+  int            reply_thread;  /*!< Index, into thread_table, of the thread
+                                     waiting for a reply from this thread or
+                                     -1 if there is none. */
+  int            waiting_for_reply; /*!< 1 iff the thread has sent a message
+                                     with SYSCALL_CALL and has not yet got the
+                                     reply. */
+  long           wakeup_time;   /*!< The system time at which a thread in the
+                                     timer wheel is made ready. */
+  int            timer_slot;    /*!< The slot of the timer wheel the thread
+                                     is in or -1 if it is not in a timer
+                                     wheel. */
+  int            timer_CPU;     /*!< Index of the CPU whose timer wheel the
+                                     thread was last inserted into. */
+  int            timer_next;    /*!< Index, into thread_table, of the next
+                                     thread in the same timer wheel slot. */
+  int            timer_previous; /*!< Index, into thread_table, of the
+                                     previous thread in the same timer wheel
+                                     slot. */
+  volatile unsigned int
+                 timeout_state; /*!< One of the TIMEOUT_ constants. Tells if
+                                     the thread is blocked with a timeout and,
+                                     if so, whether the wake up or the timeout
+                                     has won. */
+  int            timeout_object; /*!< What a thread blocked with a timeout
+                                     waits for. Either the handle of a port
+                                     or TIMEOUT_OBJECT_KEYBOARD. */
+  long           periodic_timer_period; /*!< The period, in clock ticks, of
+                                     the periodic timer of the thread or 0 if
+                                     the thread has none. */
+  long           periodic_timer_expiry; /*!< The system time at which the
+                                     periodic timer expires next. */
+  long           periodic_timer_slack; /*!< The number of clock ticks the
+                                     thread may be woken up late when the
+                                     periodic timer expires. */
  }               data;
  char            padding[1024];
 };
 
+#define MCS_NODES_PER_CPU       (8)
+/*!< The number of spin locks a CPU can hold or wait for at the same time. */
+
+/*! Defines the queue entry of a CPU holding or waiting for a spin lock. Each
+    entry has its own cache line so that a waiting CPU only spins on memory
+    nobody else touches until the lock is handed to it. */
+struct mcs_node
+{
+ struct mcs_node* volatile next;   /*!< The entry of the CPU waiting next for
+                                        the lock or 0. */
+ volatile int              locked; /*!< 1 while the CPU has to wait. Cleared
+                                        by the previous holder when it hands
+                                        over the lock. */
+} __attribute__ ((aligned (64)));
+
+/*! Defines a spin lock. The spin lock is a MCS queue lock. CPUs get the lock
+    in the order they ask for it and each waiting CPU spins on its own
+    mcs_node. Handing over the lock therefore touches one remote cache line
+    however many CPUs are waiting. A zero filled spin lock is free. */
+struct spin_lock
+{
+ struct mcs_node* volatile tail;   /*!< The entry of the CPU last in the
+                                        queue or 0 if the lock is free. */
+ struct mcs_node*          holder; /*!< The entry of the CPU holding the
+                                        lock. Only used by the holder. */
+#ifdef LOCKSTAT
+ unsigned int              lock_class; /*!< One of the LOCK_CLASS_
+                                        constants. */
+ unsigned long             acquire_time_stamp; /*!< The time stamp counter
+                                        when the holder got the lock. */
+#endif
+};
+
+#ifdef LOCKSTAT
+#define SPIN_LOCK_INITIALIZER(lock_class) {0, 0, lock_class, 0}
+#else
+#define SPIN_LOCK_INITIALIZER(lock_class) {0, 0}
+#endif
+/*!< Initializer for statically allocated spin locks. */
+
 /*! Defines a process. */
 struct process
 {
@@ -110,8 +262,57 @@ struct process
  int             parent;         /*!< This is an index into process_table. The
                                       index corresponds to the parent process. */
  unsigned long   page_table_root; /*!< Address of the page table tree. */
+ unsigned long   weight;         /*!< The share of the CPU time the process
+                                      gets relative to the other processes.
+                                      Set through SYSCALL_SETWEIGHT. */
+ unsigned long   stride;         /*!< STRIDE_ONE divided by the weight. The
+                                      amount pass is advanced by for every
+                                      clock tick the process consumes. */
+ volatile unsigned long pass;    /*!< The virtual time of the process. Among
+                                      ready threads on the same priority level
+                                      the thread of the process with the
+                                      lowest pass runs first. */
+ volatile unsigned long consumed_ticks;
+                                 /*!< The number of clock ticks threads of the
+                                      process have been running. */
+ int             first_memory_block;
+                                 /*!< Index, into page_frame_table, of the
+                                      first frame of the first memory block
+                                      owned by the process or -1. The blocks
+                                      are linked through page_frame_table.
+                                      See mm.c. */
+ unsigned long   owned_frames;   /*!< The number of page frames in the memory
+                                      blocks owned by the process. */
+ struct spin_lock
+                 memory_block_lock;
+                                 /*!< Spin lock used to ensure mutual
+                                      exclusion to first_memory_block,
+                                      owned_frames and the links of the
+                                      memory blocks. */
 };
 
+#define TIMEOUT_NONE    (0)
+/*!< The thread is not blocked with a timeout. */
+#define TIMEOUT_ARMED   (1)
+/*!< The thread is blocked both on a wait object and in a timer wheel. */
+#define TIMEOUT_WOKEN   (2)
+/*!< The thread has been taken from the wait object before the timeout. */
+#define TIMEOUT_EXPIRED (3)
+/*!< The timeout has happened before the thread was taken from the wait
+     object. */
+
+#define TIMEOUT_OBJECT_KEYBOARD (-1)
+/*!< The timeout_object of a thread waiting for a keyboard scan code. */
+
+#define STRIDE_ONE (1UL<<20)
+/*!< The pass a process with weight 1 advances by for each clock tick. */
+
+#define DEFAULT_PROCESS_WEIGHT (100)
+/*!< The weight processes start with. */
+
+#define MAX_PROCESS_WEIGHT (10000)
+/*!< The largest weight a process can be given. */
+
 /* ELF image structures. The names from the ELF64 specification are used and
    the structs are derived from the ELF64 specification. */
 
@@ -220,8 +421,17 @@ struct executable_image
                                                       header. */
 };
 
+#define FRAME_CACHE_SIZE        (16)
+/*!< The number of free page frames each CPU can keep for itself. */
+
+#define FRAME_CACHE_BATCH       (8)
+/*!< The number of page frames moved between the cache of a CPU and the
+     page frame table at a time. */
+
 /*! Defines the structure pointed to by the kernel GS_BASE. Every CPU has one
-    of these. */
+    of these. The structure is aligned to a cache line so that CPUs do not
+    share cache lines when updating their private data. The assembly code
+    depends on the offsets of the first seven members. */
 struct CPU_private
 {
  unsigned long  scratch_space;   /*!< Temporary storage used during  context
@@ -234,14 +444,92 @@ struct CPU_private
                                       thread executing on the CPU. The
                                       idle thread has index -1. */
  int            CPU_index;       /*!< Index for this CPU. */
+ volatile unsigned long
+                quiescent_state_count;
+                                 /*!< Incremented every time the CPU returns
+                                      to user mode or goes through the idle
+                                      loop. See rcu.c. */
+ volatile int   in_idle_loop;    /*!< 1 while the CPU is halted in the idle
+                                      loop. Cleared when an interrupt enters
+                                      the kernel. */
 
  int            ticks_left_of_time_slice;
-                                 /*!< Can be used by a preemptive
-                                      scheduler. */
+                                 /*!< The number of timer ticks left of the
+                                      quantum of the running thread. */
 
  unsigned int   local_apic_id;   /*!< The id of the local APIC connected
                                       to the CPU. */
-};
+
+ struct thread_queue
+                ready_queue[NUMBER_OF_PRIORITY_LEVELS];
+                                 /*!< The queues of threads that are ready to
+                                      run on the CPU. There is one queue per
+                                      priority level. */
+ unsigned long  ready_queue_bitmap;
+                                 /*!< Bit i is set iff ready_queue[i] is not
+                                      empty. */
+ struct spin_lock
+                ready_queue_lock;
+                                 /*!< Spin lock used to ensure mutual
+                                      exclusion to ready_queue. */
+ volatile int   ready_queue_length;
+                                 /*!< The number of threads in all the ready
+                                      queues. Idle CPUs read this without
+                                      holding the lock when looking for a CPU
+                                      to steal work from. */
+ int            local_timer_is_periodic;
+                                 /*!< 1 iff the local APIC timer is set to
+                                      interrupt the CPU once every clock
+                                      tick. Only used by application
+                                      processors. */
+ int            ticks_until_priority_boost;
+                                 /*!< The number of timer ticks until all
+                                      threads in the ready queues are moved
+                                      to the highest priority level. */
+ struct thread_queue
+                realtime_queue;  /*!< The realtime threads ready to run on
+                                      the CPU sorted by absolute deadline.
+                                      Protected by ready_queue_lock. */
+ unsigned long  realtime_utilization;
+                                 /*!< The sum of the utilizations, budget
+                                      divided by deadline, of the realtime
+                                      threads admitted on the CPU. Protected
+                                      by ready_queue_lock. */
+ struct scheduler_statistics
+                statistics;      /*!< Scheduler statistics. Only updated by
+                                      the CPU itself. */
+ int            handoff_thread_index;
+                                 /*!< Index, into thread_table, of a thread
+                                      the CPU is handed to at the end of the
+                                      current system call or -1. */
+ struct rcu_head*
+                rcu_next_batch;  /*!< The RCU callbacks queued on the CPU
+                                      since its last grace period started. */
+ struct rcu_head*
+                rcu_waiting_batch;
+                                 /*!< The RCU callbacks waiting for the
+                                      current grace period of the CPU. */
+ unsigned long  rcu_snapshot[MAX_NUMBER_OF_CPUS];
+                                 /*!< The quiescent_state_count of every CPU
+                                      when the current grace period of the
+                                      CPU started. */
+ unsigned int   used_mcs_nodes;  /*!< Bit i is set iff mcs_nodes[i] is in
+                                      use. */
+ struct mcs_node
+                mcs_nodes[MCS_NODES_PER_CPU];
+                                 /*!< The queue entries the CPU uses when it
+                                      grabs spin locks. The kernel runs with
+                                      interrupts disabled so only nested
+                                      locks need more than one entry. */
+ int            frame_cache_count;
+                                 /*!< The number of page frames in
+                                      frame_cache. */
+ int            frame_cache[FRAME_CACHE_SIZE];
+                                 /*!< Free page frames that only this CPU
+                                      hands out. Single page allocations and
+                                      frees use them without grabbing
+                                      page_frame_table_lock. See mm.c. */
+} __attribute__ ((aligned (64)));
 
 struct screen_position
 {
@@ -264,11 +552,11 @@ extern struct screen* const
 screen_pointer;
 /*!< Points to the VGA screen. */
 
-extern volatile unsigned int
+extern struct spin_lock
 screen_lock;
 /*!< Spin lock used to ensure mutual exclusion to the screen. */
 
-extern volatile unsigned int
+extern struct spin_lock
 page_frame_table_lock;
 /*!< Spin lock used to ensure mutual exclusion to the page_frame_table. */
 
@@ -276,15 +564,11 @@ extern union thread
 thread_table[MAX_NUMBER_OF_THREADS];
 /*!< Array holding all threads in the systems. */
 
-extern volatile unsigned int
-thread_table_lock;
-/*!< Spin lock used to ensure mutual exclusion to the thread table. */
-
 extern struct process
 process_table[MAX_NUMBER_OF_PROCESSES];
 /*!< Array holding all processes in the system. */
 
-extern volatile unsigned int
+extern struct spin_lock
 process_table_lock;
 /*!< Spin lock used to ensure mutual exclusion to the process table. */
 
@@ -293,6 +577,12 @@ CPU_private_table[MAX_NUMBER_OF_CPUS];
 /*!< Array holding all the data structures private to the CPUs in the system.
  */
 
+#ifdef LOCKSTAT
+extern struct lock_statistics
+lock_statistics_table[NUMBER_OF_LOCK_CLASSES];
+/*!< Array holding the statistics of each class of kernel locks. */
+#endif
+
 extern unsigned int
 number_of_available_CPUs;
 /*!< The number of available CPUs in the system. */
@@ -301,7 +591,7 @@ extern volatile unsigned int
 number_of_initialized_CPUs;
 /*!< The number of initialized CPUs in the system. */
 
-extern volatile unsigned int
+extern struct spin_lock
 CPU_private_table_lock;
 /*!< Spin lock used to ensure mutual exclusion to CPU_private_table. */
 
@@ -324,31 +614,32 @@ ELF_images_end;
 
 /*! \note Linked lists are terminated with a thread with a next index of -1. */
 
-extern struct thread_queue
-ready_queue;
-/*!< The ready queue. */
-
-extern volatile unsigned int
-ready_queue_lock;
-/*!< Spin lock used to ensure mutual exclusion to the ready queue. */
-
-extern int
-timer_queue_head;
-/*!< The index, into thread_table, of the head of the timer queue. The timer
-     queue is a list of threads blocked waiting for the system clock to reach
-     a certain time.  This variable is set to -1 if there are no threads in
-     the timer queue. */
-
-extern volatile unsigned int
-timer_queue_lock;
-/*!< Spin lock used to ensure mutual exclusion to the timer queue. */
-
 extern volatile long
 system_time;
 /*!< This variable holds the current system time. The system time is the
      number of clock  ticks since system start. There are 200 clock ticks
      per second. */
 
+extern volatile unsigned long
+idle_CPU_bitmap;
+/*!< Bit i is set iff the CPU with index i is idle and waits for a wakeup
+     IPI. */
+
+extern unsigned int
+local_timer_counts_per_tick;
+/*!< The number of counts the local APIC timers count down during one clock
+     tick. Measured at boot. */
+
+extern unsigned long
+time_stamp_counter_per_tick;
+/*!< The number of time stamp counter cycles during one clock tick. Measured
+     at boot. The time stamp counters of all CPUs are assumed to run in
+     step. */
+
+extern struct time_page* const
+user_time_page;
+/*!< The address at which processes can read the time page. */
+
 extern unsigned int
 pic_interrupt_map[12];
 /*!< This array maps 12 of the 16 8259 interrupts to ACPI Global System
@@ -397,6 +688,28 @@ send_IPI(register unsigned char const destination_processor_index,
 extern void
 initialize_APIC(void);
 
+/*! Stops the local APIC timer. */
+extern void
+stop_local_timer(void);
+
+/*! Ends a blocking operation that has timed out. Removes the thread from
+    the object it waits for, sets its return value to ERROR_TIMEOUT and makes
+    it ready. Called by timer_wheel_tick for threads whose timeout won. */
+extern void
+timeout_expired(const int thread_index
+                /*!< The index, into thread_table, of the thread. */);
+
+/*! Makes the local APIC timer interrupt the CPU once every clock tick. */
+extern void
+start_periodic_local_timer(void);
+
+/*! Makes the local APIC timer interrupt the CPU once after a number of clock
+    ticks. */
+extern void
+start_one_shot_local_timer(const register unsigned int ticks
+                           /*!< The number of clock ticks until the
+                                interrupt. */);
+
 /*! Helper struct that is used to return values from prepare_process. */
 struct prepare_process_return_value
 {
@@ -473,6 +786,11 @@ kprinthex(const register long value
           /*!< the value to be written */);
 
 
+/*! Prints the statistics of all classes of kernel locks on the console.
+    Does nothing unless the kernel is built with LOCKSTAT. */
+extern void
+print_lock_statistics(void);
+
 /*! Clears the VGA buffer which is used in task 7. */
 extern void
 clear_screen(void);
@@ -492,6 +810,70 @@ scheduler_called_from_timer_interrupt_handler(const register int thread_changed
                                                    has updated scheduling data 
                                                    structures.  */); 
 
+/*! Makes a thread ready to run. The thread is inserted into the ready queue
+    of the CPU it last ran on, if its affinity mask allows it, or else into
+    the ready queue of the least loaded CPU it is allowed to run on. If the
+    chosen CPU is the calling CPU and it is idle the thread is dispatched at
+    once. If the chosen CPU is another idle CPU, or runs a thread with a lower
+    priority, it is sent a wakeup IPI. If the chosen CPU is busy an idle CPU
+    is sent a wakeup IPI so that it can steal the thread. */
+extern void
+make_thread_ready(const int thread_index
+                  /*!< The index, into thread_table, of the thread to make
+                       ready. */);
+
+/*! Lets a thread run on the calling CPU, without going through the ready
+    queues, when the running thread blocks at the end of the current system
+    call. The thread is made ready the usual way instead if it is not allowed
+    to run on the CPU or if a realtime thread is waiting for the CPU. The
+    system call must request scheduling. */
+extern void
+hand_off_CPU(const int thread_index
+             /*!< The index, into thread_table, of the thread to run. */);
+
+/*! Lets a thread run on the calling CPU at the end of the current system
+    call. The running thread is put in the ready queues. The thread is made
+    ready the usual way instead, and the running thread keeps running, if the
+    thread has a lower priority than the running thread, is not allowed to
+    run on the CPU or if a realtime thread is waiting for the CPU.
+    \returns 1 if the system call must request scheduling and 0 otherwise. */
+extern int
+directed_yield(const int thread_index
+               /*!< The index, into thread_table, of the thread to run. */);
+
+/*! Moves a thread into, or out of, the realtime scheduling class. The
+    thread is admitted on the first CPU, starting with the calling CPU and
+    restricted by the affinity mask of the thread, where the utilization of
+    the realtime threads stays below MAX_REALTIME_UTILIZATION. The thread is
+    then bound to that CPU. Its first period starts at once.
+    \returns The index of the CPU the thread is to run on or -1 if the
+             parameters are invalid or the thread cannot be admitted. */
+extern int
+set_realtime_parameters(const int  thread_index
+                        /*!< The index, into thread_table, of the thread. */,
+                        const long period
+                        /*!< The period in clock ticks. 0 moves the thread
+                             back to the best-effort class. */,
+                        const long budget
+                        /*!< The number of clock ticks the thread may run
+                             each period. */,
+                        const long deadline
+                        /*!< The deadline relative to the start of the period.
+                             0 means the end of the period. */);
+
+/*! Ends the current period of a realtime thread. The thread is put in the
+    timer wheel until its next period starts and then gets a full budget. It
+    is made ready at once if the next period has already started. The thread
+    must not be in any ready queue. */
+extern void
+start_next_period(const int thread_index
+                  /*!< The index, into thread_table, of the thread. */);
+
+/*! One of three entry points to the scheduler. This function is called from
+    the wakeup IPI handler. */
+extern void
+scheduler_called_from_wakeup_IPI_handler(void);
+
 /*! Initializes the network subsystem. */
 extern void
 initialize_network(void);
@@ -537,6 +919,16 @@ inw(const short port_number)
  return return_value;
 }
 
+/*! Wrapper for the rdtsc instruction.
+  \returns The time stamp counter of the CPU. */
+inline static unsigned long
+read_time_stamp_counter(void)
+{
+ register unsigned int low, high;
+ __asm volatile("rdtsc" : "=a" (low), "=d" (high));
+ return (((unsigned long) high)<<32) | low;
+}
+
 /*! Get the thread currently executing on the CPU.
   \returns The index into the thread_table for the current thread. The function
            returns -1 if the CPU is not executing any thread. */
@@ -587,76 +979,263 @@ lock_cmpxchg(register volatile unsigned int * const pointer_to_variable
 }
 
 
-/*! Grabs a spin lock with write permissions */
+/*! Wrapper for a 64-bit locked or instruction. Sets bits atomically. */
 inline static void
-grab_lock_rw(register volatile unsigned int * const spin_lock
-              /*!< Points to the spin lock. */)
+lock_or(register volatile unsigned long * const pointer_to_variable
+                                                /*!< Pointer to the variable to
+                                                     operate on. */,
+        register const unsigned long     bits   /*!< The bits to set. */)
 {
- while (1)
- {
-  while (*spin_lock !=0);
+ __asm volatile("lock orq %1,%0"
+                : "+m" (*pointer_to_variable)
+                : "r" (bits)
+                : "memory");
+}
 
-  if (0 == lock_cmpxchg(spin_lock, 0, 0x80000000))
-   return;
+/*! Wrapper for a 64-bit locked add instruction. Adds atomically. */
+inline static void
+lock_add(register volatile unsigned long * const pointer_to_variable
+                                                /*!< Pointer to the variable to
+                                                     operate on. */,
+         register const unsigned long     value /*!< The value to add. */)
+{
+ __asm volatile("lock addq %1,%0"
+                : "+m" (*pointer_to_variable)
+                : "r" (value)
+                : "memory");
+}
+
+/*! Wrapper for a 64-bit locked and instruction. Clears bits atomically. */
+inline static void
+lock_and(register volatile unsigned long * const pointer_to_variable
+                                                /*!< Pointer to the variable to
+                                                     operate on. */,
+         register const unsigned long     bits  /*!< The bits to keep. */)
+{
+ __asm volatile("lock andq %1,%0"
+                : "+m" (*pointer_to_variable)
+                : "r" (bits)
+                : "memory");
+}
+
+/*! Wrapper for a 64-bit xchg instruction on a pointer to a queue entry.
+    \returns The value stored in the variable before the operation. */
+inline static struct mcs_node*
+lock_xchg_mcs_node(register struct mcs_node* volatile * const
+                                                 pointer_to_variable
+                                                /*!< Pointer to the variable to
+                                                     operate on. */,
+                   register struct mcs_node*     new_value
+                                                /*!< The value to write to the
+                                                     variable. */)
+{
+ __asm volatile("xchgq %0,%1"
+                : "+r" (new_value), "+m" (*pointer_to_variable)
+                :
+                : "memory");
+
+ return new_value;
+}
+
+/*! Wrapper for a 64-bit locked cmpxchg instruction on a pointer to a queue
+    entry.
+    \returns The value stored in the variable before the operation. */
+inline static struct mcs_node*
+lock_cmpxchg_mcs_node(register struct mcs_node* volatile * const
+                                                 pointer_to_variable
+                                                /*!< Pointer to the variable to
+                                                     operate on. */,
+                      register struct mcs_node*  old_value
+                                                /*!< The value assumed to be in
+                                                     the variable. */,
+                      register struct mcs_node* const new_value
+                                                /*!< The value to conditionally
+                                                     write to the variable. */)
+{
+ __asm volatile("lock cmpxchgq %2,%1"
+                : "+a" (old_value), "+m" (*pointer_to_variable)
+                : "r" (new_value)
+                : "memory", "cc");
+
+ return old_value;
+}
+
+/*! Tells the CPU that it is spinning in a wait loop. This saves power and
+    avoids a pipeline flush when the loop exits. */
+inline static void
+spin_pause(void)
+{
+ __asm volatile("pause" : : : "memory");
+}
+
+/*! Initializes a spin lock to be free. */
+inline static void
+initialize_spin_lock(register struct spin_lock* const spin_lock
+                      /*!< Points to the spin lock. */,
+                     const unsigned int lock_class
+                      /*!< One of the LOCK_CLASS_ constants. */)
+{
+ spin_lock->tail = 0;
+ spin_lock->holder = 0;
+#ifdef LOCKSTAT
+ spin_lock->lock_class = lock_class;
+#endif
+}
+
+#ifdef LOCKSTAT
+/*! Counts a lock acquisition in the statistics of its class.
+    \returns The time stamp counter when the lock was acquired. */
+inline static unsigned long
+record_lock_acquisition(const unsigned int  lock_class
+                         /*!< The class of the lock. */,
+                        const unsigned long start
+                         /*!< The time stamp counter when the CPU started to
+                              grab the lock. */,
+                        const int           contended
+                         /*!< 1 if the CPU had to wait for the lock. */)
+{
+ register struct lock_statistics* const statistics =
+  &lock_statistics_table[lock_class];
+ register const unsigned long now = read_time_stamp_counter();
+
+ /* Locks of the same class are held by several CPUs at once so the
+    counters are updated atomically. */
+ lock_add(&statistics->acquisitions, 1);
+ if (contended)
+ {
+  lock_add(&statistics->contended_acquisitions, 1);
+  lock_add(&statistics->spin_cycles, now - start);
  }
+
+ return now;
 }
 
-/*! Grabs a spin lock with read permissions. */
+/*! Records how long a lock was held in the statistics of its class. */
 inline static void
-grab_lock_r(register volatile unsigned int * const spin_lock
-              /*!< Points to the spin lock. */)
+record_lock_release(const unsigned int  lock_class
+                     /*!< The class of the lock. */,
+                    const unsigned long acquire_time_stamp
+                     /*!< The time stamp counter when the lock was
+                          acquired. */)
 {
- while (1)
+ register volatile unsigned long* const max_hold_cycles =
+  &lock_statistics_table[lock_class].max_hold_cycles;
+ register const unsigned long hold_cycles =
+  read_time_stamp_counter() - acquire_time_stamp;
+ register unsigned long old_value = *max_hold_cycles;
+
+ while (hold_cycles > old_value)
  {
-  register unsigned int spin_lock_value, new_spin_lock_value;
+  register unsigned long seen_value = old_value;
+
+  __asm volatile("lock cmpxchgq %2,%1"
+                 : "+a" (seen_value), "+m" (*max_hold_cycles)
+                 : "r" (hold_cycles)
+                 : "memory", "cc");
+  if (seen_value == old_value)
+   break;
+  old_value = seen_value;
+ }
+}
+#endif
 
-  while (((*spin_lock) & 0x80000000) !=0);
+/*! Takes a free queue entry of the calling CPU.
+    \returns A pointer to the queue entry. */
+inline static struct mcs_node*
+allocate_mcs_node(void)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+ register unsigned int free_nodes =
+  ~cpu->used_mcs_nodes & ((1U<<MCS_NODES_PER_CPU)-1);
+ register unsigned int node_index;
 
-  new_spin_lock_value = *spin_lock;
+ while (0 == free_nodes)
+  kprints("Kernel panic! Too many nested spin locks.\n");
 
-  while (1)
-  {
-   spin_lock_value = new_spin_lock_value;
+ __asm ("bsfl %1,%0" : "=r" (node_index) : "r" (free_nodes) : "cc");
+ cpu->used_mcs_nodes |= 1U<<node_index;
 
-   if (spin_lock_value > 0x7ffffffe)
-    break;
+ return &cpu->mcs_nodes[node_index];
+}
 
-   new_spin_lock_value = lock_cmpxchg(spin_lock,
-                                      spin_lock_value,
-                                      spin_lock_value+1);
-   if (new_spin_lock_value == spin_lock_value)
-    return;
-  }
- }
+/*! Returns a queue entry to the calling CPU. */
+inline static void
+free_mcs_node(register struct mcs_node* const node
+               /*!< Points to the queue entry. */)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ cpu->used_mcs_nodes &= ~(1U<<(node - cpu->mcs_nodes));
 }
 
-/*! Releases a spin lock. */
+/*! Grabs a spin lock with write permissions. The calling CPU is put last in
+    the queue of the lock and spins on its own queue entry until the CPU
+    before it releases the lock. */
 inline static void
-release_lock(register volatile unsigned int * const spin_lock
+grab_lock_rw(register struct spin_lock* const spin_lock
               /*!< Points to the spin lock. */)
 {
- register unsigned int spin_lock_value, new_spin_lock_value;
+ register struct mcs_node* const node = allocate_mcs_node();
+ register struct mcs_node*       predecessor;
+#ifdef LOCKSTAT
+ register const unsigned long    start = read_time_stamp_counter();
+#endif
 
- new_spin_lock_value = *spin_lock;
+ node->next = 0;
+ node->locked = 1;
 
- while (1)
+ predecessor = lock_xchg_mcs_node(&spin_lock->tail, node);
+ if (0 != predecessor)
  {
-  spin_lock_value = new_spin_lock_value;
+  predecessor->next = node;
+
+  while (node->locked)
+   spin_pause();
+ }
+
+ spin_lock->holder = node;
+#ifdef LOCKSTAT
+ spin_lock->acquire_time_stamp =
+  record_lock_acquisition(spin_lock->lock_class, start, 0 != predecessor);
+#endif
+}
+
+/*! Releases a spin lock. The lock is handed directly to the next CPU in the
+    queue, if there is one. */
+inline static void
+release_lock(register struct spin_lock* const spin_lock
+              /*!< Points to the spin lock. */)
+{
+ register struct mcs_node* const node = spin_lock->holder;
 
-  if (0x80000000 == spin_lock_value)
-   new_spin_lock_value = 0;
-  else
-   new_spin_lock_value = spin_lock_value-1;
+ while (0 == node)
+  kprints("Kernel panic! Corrupt lock state.\n");
 
-  while (0 != (new_spin_lock_value&0x80000000))
-   kprints("Kernel panic! Corrupt lock state.\n");
+#ifdef LOCKSTAT
+ record_lock_release(spin_lock->lock_class, spin_lock->acquire_time_stamp);
+#endif
 
-  new_spin_lock_value = lock_cmpxchg(spin_lock,
-                                     spin_lock_value,
-                                     new_spin_lock_value);
-  if (new_spin_lock_value == spin_lock_value)
+ /* Keep the stores of the critical section before the hand over. */
+ __asm volatile("" : : : "memory");
+
+ if (0 == node->next)
+ {
+  /* No CPU is known to wait. Free the lock unless one has just queued. */
+  if (node == lock_cmpxchg_mcs_node(&spin_lock->tail, node, 0))
+  {
+   free_mcs_node(node);
    return;
+  }
+
+  /* A CPU is about to link itself in after this one. */
+  while (0 == node->next)
+   spin_pause();
  }
+
+ node->next->locked = 0;
+ free_mcs_node(node);
 }
 
 /*! Wrapper for reading the cr2 register.
@@ -6,35 +6,522 @@
 
 /* Variable definitions. */
 
-struct page_frame
-page_frame_table[MAX_NUMBER_OF_FRAMES];
-
 /* Set when the system is initialized. */
+struct page_frame*
+page_frame_table;
+
 unsigned long memory_pages;
 
-/* The following three variables are set by the assembly code. */
+/* The following four variables are set by the assembly code. */
 unsigned long first_available_memory_byte;
 
 unsigned long memory_size;
 
 unsigned long kernel_page_table_root;
 
+unsigned long multiboot_information;
+
+/*! An entry in the multiboot memory map. The size member gives the distance
+    to the next entry, not counting the size member itself. */
+struct memory_map_entry
+{
+ unsigned int  size;          /*!< The size of the rest of the entry. */
+ unsigned long base_address;  /*!< The first byte of the memory block. */
+ unsigned long length;        /*!< The size, in bytes, of the block. */
+ unsigned int  type;          /*!< 1 if the block is available memory. */
+} __attribute__ ((packed));
+
+/*! The first free block of each order or -1. */
+static int
+free_list_head[MAX_FRAME_ORDER+1];
+
+/*! Bit k is set iff free_list_head[k] is not -1. */
+static unsigned long
+free_list_bitmap;
+
 /* Function definitions. */
 
-/* Change this function in task B4. */
+/* The page frames are managed by a binary buddy allocator. Free memory is
+   kept in blocks of 2^k frames, each on the free list of its order k. An
+   allocation takes the first block of the smallest order that is large
+   enough, splitting larger blocks as needed. The frames of the block that
+   are not needed are freed again right away. A freed block is merged with
+   its buddy, the other half of the block of the next higher order, for as
+   long as the buddy is free. Both take time proportional to the number of
+   orders, not to the number of frames. The free lists are doubly linked
+   through the page frame table so that a buddy can be unlinked when it is
+   merged. All functions below are called with page_frame_table_lock
+   held. */
+
+/*! Puts a block on the free list of its order. */
+static void
+link_free_block(const int frame, const int order)
+{
+ register const int next = free_list_head[order];
+
+ page_frame_table[frame].free_order = order;
+ page_frame_table[frame].previous_free = -1;
+ page_frame_table[frame].next_free = next;
+ if (-1 != next)
+  page_frame_table[next].previous_free = frame;
+ free_list_head[order] = frame;
+ free_list_bitmap |= 1UL<<order;
+}
+
+/*! Takes a block off the free list of its order. */
+static void
+unlink_free_block(const int frame)
+{
+ register const int order = page_frame_table[frame].free_order;
+ register const int previous = page_frame_table[frame].previous_free;
+ register const int next = page_frame_table[frame].next_free;
+
+ if (-1 == previous)
+  free_list_head[order] = next;
+ else
+  page_frame_table[previous].next_free = next;
+
+ if (-1 != next)
+  page_frame_table[next].previous_free = previous;
+
+ if (-1 == free_list_head[order])
+  free_list_bitmap &= ~(1UL<<order);
+
+ page_frame_table[frame].free_order = -1;
+}
+
+/*! Frees a block and merges it with its buddies. */
+static void
+free_block(register int frame, register int order)
+{
+ while (order < MAX_FRAME_ORDER)
+ {
+  register const int buddy = frame ^ (1<<order);
+
+  if ((buddy + (1<<order) > memory_pages) ||
+      (order != page_frame_table[buddy].free_order))
+   break;
+
+  unlink_free_block(buddy);
+  if (buddy < frame)
+   frame = buddy;
+  order++;
+ }
+
+ link_free_block(frame, order);
+}
+
+/*! Marks a range of page frames as free and hands it to the free lists as
+    the largest aligned blocks it can be split into. */
+static void
+free_frame_range(register unsigned long frame,
+                 register unsigned long number_of_frames)
+{
+ register unsigned long i;
+
+ for(i=frame; i<frame+number_of_frames; i++)
+ {
+  page_frame_table[i].owner = -1;
+  page_frame_table[i].start = -1;
+  page_frame_table[i].free_is_allowed = 1;
+ }
+
+ while (number_of_frames > 0)
+ {
+  register unsigned long order;
+
+  /* The block must be aligned to its size and fit in the range. */
+  __asm ("bsrq %1,%0" : "=r" (order) : "r" (number_of_frames) : "cc");
+  if ((0 != frame) && (order > __builtin_ctzl(frame)))
+   order = __builtin_ctzl(frame);
+  if (order > MAX_FRAME_ORDER)
+   order = MAX_FRAME_ORDER;
+
+  free_block(frame, order);
+  frame += 1UL<<order;
+  number_of_frames -= 1UL<<order;
+ }
+}
+
+/*! Takes a block of the given order, or a larger one split down to size,
+    off the free lists. Returns the index of the first frame of the block
+    and the order of the block taken in block_order, or -1 if no block is
+    large enough. */
+static int
+take_free_block(const unsigned long order, unsigned long* block_order)
+{
+ register const unsigned long available_orders =
+  free_list_bitmap & ~((1UL<<order)-1);
+ register int frame;
+
+ if (0 == available_orders)
+  return -1;
+
+ __asm ("bsfq %1,%0" : "=r" (*block_order) : "r" (available_orders) : "cc");
+ frame = free_list_head[*block_order];
+ unlink_free_block(frame);
+ return frame;
+}
+
+/* Each CPU keeps a small cache of free page frames in its CPU_private_table
+   entry. A single page kalloc or kfree only touches the cache of the CPU
+   it runs on, and the kernel runs with interrupts disabled, so the cache
+   needs no lock. The cache is refilled from, and drained to, the free
+   lists FRAME_CACHE_BATCH frames at a time which keeps the number of times
+   page_frame_table_lock is grabbed low. A frame in a cache is marked free
+   in page_frame_table but is on no free list, i.e., its free_order is -1,
+   so it is never merged with its buddy while cached. */
+
+/*! Moves frames from the cache of the CPU to the free lists until at most
+    keep frames remain. The caller must hold page_frame_table_lock. */
+static void
+drain_frame_cache(struct CPU_private* const cpu, const int keep)
+{
+ while (cpu->frame_cache_count > keep)
+ {
+  cpu->frame_cache_count--;
+  free_block(cpu->frame_cache[cpu->frame_cache_count], 0);
+ }
+}
+
+/*! Returns a free frame from the cache of the CPU, refilling the cache
+    first if it is empty. Returns -1 if there are no free frames. */
+static int
+get_cached_frame(void)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ if (0 == cpu->frame_cache_count)
+ {
+  unsigned long block_order;
+
+  grab_lock_rw(&page_frame_table_lock);
+  while (cpu->frame_cache_count < FRAME_CACHE_BATCH)
+  {
+   register const int frame = take_free_block(0, &block_order);
+
+   if (-1 == frame)
+    break;
+   /* Split off one frame and give back the rest of the block. */
+   free_frame_range(frame+1, (1UL<<block_order)-1);
+   cpu->frame_cache[cpu->frame_cache_count++] = frame;
+  }
+  release_lock(&page_frame_table_lock);
+
+  if (0 == cpu->frame_cache_count)
+   return -1;
+ }
+
+ return cpu->frame_cache[--cpu->frame_cache_count];
+}
+
+/*! Puts a frame, already marked free, in the cache of the CPU. A full
+    cache is drained down to FRAME_CACHE_SIZE-FRAME_CACHE_BATCH frames
+    first. */
+static void
+put_cached_frame(const int frame)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ if (FRAME_CACHE_SIZE == cpu->frame_cache_count)
+ {
+  grab_lock_rw(&page_frame_table_lock);
+  drain_frame_cache(cpu, FRAME_CACHE_SIZE-FRAME_CACHE_BATCH);
+  release_lock(&page_frame_table_lock);
+ }
+
+ cpu->frame_cache[cpu->frame_cache_count++] = frame;
+}
+
+void
+initialize_page_frames(void)
+{
+ /* The available memory blocks, as first and end frame indices. They are
+    copied from the memory map before page_frame_table, which may overwrite
+    it, is set up. */
+ unsigned long          available_blocks[MAX_MEMORY_MAP_ENTRIES][2];
+ register int           number_of_available_blocks = 0;
+ register unsigned long first_free_frame;
+ register unsigned long i;
+
+ memory_pages = memory_size/(4*1024);
+ if (memory_pages > MAX_NUMBER_OF_FRAMES)
+  memory_pages = MAX_NUMBER_OF_FRAMES;
+
+ /* Bit 6 of the multiboot flags is set if the memory map is present. */
+ if (0 != (*((unsigned int*) multiboot_information) & (1<<6)))
+ {
+  register const unsigned long map_length =
+   *((unsigned int*) (multiboot_information+44));
+  register unsigned long entry_address =
+   *((unsigned int*) (multiboot_information+48));
+  register const unsigned long map_end = entry_address + map_length;
+
+  while ((entry_address < map_end) &&
+         (number_of_available_blocks < MAX_MEMORY_MAP_ENTRIES))
+  {
+   register const struct memory_map_entry* const entry =
+    (const struct memory_map_entry*) entry_address;
+
+   if (1 == entry->type)
+   {
+    /* Only whole page frames inside the block can be used. */
+    available_blocks[number_of_available_blocks][0] =
+     (entry->base_address+4*1024-1)/(4*1024);
+    available_blocks[number_of_available_blocks][1] =
+     (entry->base_address+entry->length)/(4*1024);
+    number_of_available_blocks++;
+   }
+
+   entry_address += entry->size + sizeof(entry->size);
+  }
+ }
+ else
+ {
+  /* Without a memory map all memory below memory_size is used. */
+  available_blocks[0][0] = 0;
+  available_blocks[0][1] = memory_pages;
+  number_of_available_blocks = 1;
+ }
+
+ /* Place the page frame table after the kernel and executable images. */
+ page_frame_table = (struct page_frame*) first_available_memory_byte;
+ first_available_memory_byte +=
+  (memory_pages*sizeof(struct page_frame)+4*1024-1) & ~(4*1024UL-1);
+ first_free_frame = first_available_memory_byte/(4*1024);
+
+ /* Mark all page frames as taken by the kernel (-2 in the owner field)
+    until they are found in an available memory block. */
+ for(i=0; i<memory_pages; i++)
+ {
+  page_frame_table[i].owner = KERNEL_FRAME_OWNER;
+  page_frame_table[i].start = -1;
+  page_frame_table[i].free_is_allowed = 0;
+  page_frame_table[i].free_order = -1;
+ }
+
+ for(i=0; i<=MAX_FRAME_ORDER; i++)
+  free_list_head[i] = -1;
+ free_list_bitmap = 0;
+
+ /* Hand the available frames that are not used by the kernel to the buddy
+    allocator. */
+ for(i=0; i<number_of_available_blocks; i++)
+ {
+  register unsigned long first = available_blocks[i][0];
+  register unsigned long end = available_blocks[i][1];
+
+  if (first < first_free_frame)
+   first = first_free_frame;
+  if (end > memory_pages)
+   end = memory_pages;
+
+  if (first < end)
+   free_frame_range(first, end-first);
+ }
+}
+
+/* The memory blocks owned by a process are kept in a doubly linked list
+   headed by first_memory_block in its process_table entry. The list is
+   linked through the next_free and previous_free members of the first
+   frame of each block, which are not used while the block is allocated.
+   Freeing all memory of a process therefore only touches the frames it
+   owns. The list, and the owner of the first frame of each block on it,
+   only change with the memory_block_lock of the process held. The owner
+   is set last when a block is added so kfree never sees a block that is
+   not on the list. */
+
+/*! Hands a memory block to a process and puts it on the list of the
+    process. Blocks owned by the kernel are not put on any list. */
+static void
+add_memory_block(const int process,
+                 const int frame,
+                 const unsigned long number_of_frames)
+{
+ register struct process* process_ptr;
+
+ if (process < 0)
+ {
+  page_frame_table[frame].owner = process;
+  return;
+ }
+
+ process_ptr = &process_table[process];
+ grab_lock_rw(&process_ptr->memory_block_lock);
+
+ page_frame_table[frame].previous_free = -1;
+ page_frame_table[frame].next_free = process_ptr->first_memory_block;
+ if (-1 != process_ptr->first_memory_block)
+  page_frame_table[process_ptr->first_memory_block].previous_free = frame;
+ process_ptr->first_memory_block = frame;
+ process_ptr->owned_frames += number_of_frames;
+
+ page_frame_table[frame].owner = process;
+
+ release_lock(&process_ptr->memory_block_lock);
+}
+
+/*! Counts the frames of an allocated memory block. */
+static unsigned long
+memory_block_length(const unsigned long frame)
+{
+ register unsigned long end;
+
+ for(end=frame+1;
+     (end<memory_pages) && (page_frame_table[end].start == frame);
+     end++);
+
+ return end-frame;
+}
+
 extern long
 kalloc(const register unsigned long length,
        const register unsigned int  process,
        const register unsigned long flags)
 {
- return ERROR;
+ register const unsigned long number_of_frames = (length+4*1024-1)/(4*1024);
+ register unsigned long       order = 0;
+ unsigned long                block_order;
+ register int                 frame;
+ register unsigned long       i;
+
+ if ((0 == number_of_frames) || (number_of_frames > (1UL<<MAX_FRAME_ORDER)))
+  return ERROR;
+
+ if (1 == number_of_frames)
+ {
+  frame = get_cached_frame();
+  if (-1 == frame)
+   return ERROR;
+
+  page_frame_table[frame].start = frame;
+  page_frame_table[frame].free_is_allowed = !(flags & ALLOCATE_FLAG_KERNEL);
+  add_memory_block(process, frame, 1);
+  return ((long) frame)*4*1024;
+ }
+
+ while ((1UL<<order) < number_of_frames)
+  order++;
+
+ grab_lock_rw(&page_frame_table_lock);
+
+ /* Find the smallest order with a free block that is large enough. */
+ frame = take_free_block(order, &block_order);
+ if (-1 == frame)
+ {
+  /* The frames cached by this CPU may complete a block. */
+  drain_frame_cache(&CPU_private_table[get_processor_index()], 0);
+  frame = take_free_block(order, &block_order);
+  if (-1 == frame)
+  {
+   release_lock(&page_frame_table_lock);
+   return ERROR;
+  }
+ }
+
+ for(i=frame; i<frame+number_of_frames; i++)
+ {
+  page_frame_table[i].owner = process;
+  page_frame_table[i].start = frame;
+  page_frame_table[i].free_is_allowed = !(flags & ALLOCATE_FLAG_KERNEL);
+ }
+ /* The owner of the first frame is set when the block is on the list of
+    the process. */
+ page_frame_table[frame].owner = -1;
+
+ /* Give back the frames the allocation does not need. */
+ free_frame_range(frame+number_of_frames,
+                  (1UL<<block_order)-number_of_frames);
+
+ release_lock(&page_frame_table_lock);
+
+ add_memory_block(process, frame, number_of_frames);
+
+ return ((long) frame)*4*1024;
 }
 
-/* Change this function in task B4. */
 long
-kfree(const register unsigned long address)
+kfree(const register unsigned long address,
+      const register int           process)
 {
- return ERROR;
+ register const unsigned long frame = address/(4*1024);
+ register unsigned long       number_of_frames;
+ register struct process*     process_ptr;
+ register int                 previous;
+ register int                 next;
+
+ if ((0 != (address & (4*1024-1))) || (frame >= memory_pages) ||
+     (process < 0) || (page_frame_table[frame].owner != process))
+  return ERROR;
+
+ process_ptr = &process_table[process];
+ grab_lock_rw(&process_ptr->memory_block_lock);
+
+ /* Only whole memory blocks allocated by kalloc to the process can be
+    freed. Check again with the lock held as another CPU may have freed the
+    block. */
+ if ((page_frame_table[frame].owner != process) ||
+     (page_frame_table[frame].start != frame) ||
+     !page_frame_table[frame].free_is_allowed)
+ {
+  release_lock(&process_ptr->memory_block_lock);
+  return ERROR;
+ }
+
+ /* Take the block off the list of the process. */
+ previous = page_frame_table[frame].previous_free;
+ next = page_frame_table[frame].next_free;
+ if (-1 == previous)
+  process_ptr->first_memory_block = next;
+ else
+  page_frame_table[previous].next_free = next;
+ if (-1 != next)
+  page_frame_table[next].previous_free = previous;
+
+ number_of_frames = memory_block_length(frame);
+ process_ptr->owned_frames -= number_of_frames;
+ page_frame_table[frame].owner = -1;
+
+ release_lock(&process_ptr->memory_block_lock);
+
+ if (1 == number_of_frames)
+ {
+  page_frame_table[frame].start = -1;
+  page_frame_table[frame].free_is_allowed = 1;
+  put_cached_frame(frame);
+  return ALL_OK;
+ }
+
+ grab_lock_rw(&page_frame_table_lock);
+ free_frame_range(frame, number_of_frames);
+ release_lock(&page_frame_table_lock);
+
+ return ALL_OK;
+}
+
+void
+free_frames_of_process(const int process)
+{
+ register struct process* const process_ptr = &process_table[process];
+ register int                   frame;
+
+ grab_lock_rw(&process_ptr->memory_block_lock);
+
+ frame = process_ptr->first_memory_block;
+ while (-1 != frame)
+ {
+  register const int next = page_frame_table[frame].next_free;
+
+  free_frame_range(frame, memory_block_length(frame));
+  frame = next;
+ }
+
+ process_ptr->first_memory_block = -1;
+ process_ptr->owned_frames = 0;
+
+ release_lock(&process_ptr->memory_block_lock);
 }
 
 /* Change this function in task A4. */
@@ -6,12 +6,25 @@
 
 /* Macro definitions. */
 
-#define MAX_NUMBER_OF_FRAMES    (32*1024*1024/(4*1024))
-/*!< The maximum number of page frames the system can support. */
+#define MAX_NUMBER_OF_FRAMES    (3UL*1024*1024*1024/(4*1024))
+/*!< The maximum number of page frames the system can support. The kernel
+     maps physical memory up to 3 Gbytes, below the APIC and IO-APIC
+     mappings. boot32.s and boot64.s use the same limit. */
+
+#define MAX_FRAME_ORDER         (13)
+/*!< The largest order of a block of page frames. A block of order k holds
+     2^k page frames and starts at a frame index evenly divisible by 2^k. */
+
+#define MAX_MEMORY_MAP_ENTRIES  (32)
+/*!< The maximum number of entries read from the multiboot memory map. */
 
 #define ALLOCATE_FLAG_KERNEL             (4)
 /*!< Set if the memory block can only be de-allocated by the kernel. */
 
+#define KERNEL_FRAME_OWNER               (-2)
+/*!< The owner of page frames taken by the kernel itself. They are never
+     freed. */
+
 /*! This Macro extends the flags defined for the p_flags in the ELF program
    header entries. */
 #define PF_KERNEL 0x8 /*!< Segment can only be accessed from the kernel. */
@@ -34,6 +47,20 @@ struct page_frame
                              memory block. */
  int             free_is_allowed; /*!< Flag that is zero if the page must 
                                        not be de-allocated with free. */
+ int             free_order; /*!< The order of the free block starting at
+                                  the page frame or -1 if no free block
+                                  starts here. */
+ int             next_free; /*!< Index into the page frame table of the
+                                 next free block of the same order or -1.
+                                 In the first frame of an allocated memory
+                                 block, the next block owned by the same
+                                 process or -1. */
+ int             previous_free; /*!< Index into the page frame table of the
+                                     previous free block of the same order
+                                     or -1. In the first frame of an
+                                     allocated memory block, the previous
+                                     block owned by the same process or
+                                     -1. */
 };
 
 /*! Defines a page-map level-4 table, a page-directory pointer table,
@@ -45,9 +72,11 @@ struct page_table
 
 /* Variable declarations. */
 
-extern struct page_frame
-page_frame_table[MAX_NUMBER_OF_FRAMES];
-/*!< Array holding information on all the page frames in physical memory. */
+extern struct page_frame*
+page_frame_table;
+/*!< Array holding information on all the page frames in physical memory. It
+     has memory_pages entries and is placed right after the kernel when the
+     system is initialized. */
 
 extern unsigned long
 first_available_memory_byte;
@@ -55,12 +84,18 @@ first_available_memory_byte;
 
 extern unsigned long
 memory_size;
-/*!< Size, in bytes, of the memory. */
+/*!< The address, in bytes, of the end of the highest block of available
+     memory. */
 
 extern unsigned long
 memory_pages;
 /*!< Size, in pages, of the memory. */
 
+extern unsigned long
+multiboot_information;
+/*!< The address of the multiboot information structure passed by the boot
+     loader. */
+
 extern unsigned long
 kernel_page_table_root;
 /*!< The address of the page table tree that the kernel installs when 
@@ -79,11 +114,28 @@ kalloc(const register unsigned long length
        const register unsigned long flags
         /*!< Flags indicating the type of memory block to allocate.*/);
 
-/*! De-allocates a memory block previously allocated via kalloc.
+/*! De-allocates a memory block previously allocated via kalloc. Only the
+    process owning the block may free it.
     \return 0 if sucessful or an error code if not successful. */
 extern long
 kfree(const register unsigned long address
-       /*!< The address of the memory block to free. */);
+       /*!< The address of the memory block to free. */,
+      const register int           process
+       /*!< The process freeing the memory block. */);
+
+/*! Sets up page_frame_table when the system is initialized. Frames used by
+    the kernel and executable images, and frames in holes of the multiboot
+    memory map, are marked as taken by the kernel. The rest are handed to
+    the buddy allocator. */
+extern void
+initialize_page_frames(void);
+
+/*! Frees all page frames owned by a process, including those that cannot be
+    freed by kfree. Only the memory blocks on the list of the process are
+    visited. The caller must hold page_frame_table_lock. */
+extern void
+free_frames_of_process(const int process
+                        /*!< Index into process_table of the process. */);
 
 /*! Change the protection of a range of pages in a page table. To
     be implemented in task A4. */
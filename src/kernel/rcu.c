@@ -0,0 +1,104 @@
+/*! \file rcu.c
+    \brief Holds the implementation of read-copy-update.
+
+    Readers of read-mostly kernel tables do not take locks. A writer unlinks
+    an object, or marks it as dying, and hands it to call_rcu. The object is
+    reclaimed when every CPU has passed a quiescent state, a point where it
+    cannot hold references found by a reader. As the kernel is not
+    preemptive and readers do not block, every return to user mode is a
+    quiescent state. enter.s counts them in the quiescent_state_count member
+    of CPU_private. A CPU halted in the idle loop is also quiescent. enter.s
+    marks that with in_idle_loop, which is cleared as soon as an interrupt
+    brings the CPU back into the kernel.
+
+    Each CPU keeps its callbacks in two batches. New callbacks go into the
+    next batch. The waiting batch has a snapshot of the quiescent state
+    counts of all CPUs taken when it started waiting. Once every CPU has
+    either changed its count or is idle the grace period has elapsed and the
+    waiting batch is run. Everything is per CPU and runs with interrupts
+    disabled so no locks are needed. */
+
+#include "kernel.h"
+#include "rcu.h"
+
+/* The function interfaces are documented in rcu.h */
+
+void
+call_rcu(struct rcu_head* const head,
+         void (* const function)(struct rcu_head*))
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ head->function = function;
+ head->next = cpu->rcu_next_batch;
+ cpu->rcu_next_batch = head;
+}
+
+/*! Checks if all CPUs have passed a quiescent state since a CPU took the
+    snapshot of its waiting batch. The calling CPU is in the timer interrupt
+    which is a quiescent state in itself, as readers do not block and the
+    kernel is not preemptive. This matters for an idle CPU. It cannot see
+    itself in the idle loop as in_idle_loop is cleared on the way in.
+    \returns 1 if the grace period has elapsed and 0 otherwise. */
+static int
+grace_period_elapsed(register const struct CPU_private* const cpu)
+{
+ register int i;
+
+ for(i=0; i<number_of_available_CPUs; i++)
+ {
+  if ((i != cpu->CPU_index) &&
+      (CPU_private_table[i].quiescent_state_count ==
+       cpu->rcu_snapshot[i]) &&
+      !CPU_private_table[i].in_idle_loop)
+   return 0;
+ }
+
+ return 1;
+}
+
+void
+rcu_tick(void)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+ register int i;
+
+ if (0 != cpu->rcu_waiting_batch)
+ {
+  register struct rcu_head* head;
+
+  if (!grace_period_elapsed(cpu))
+   return;
+
+  head = cpu->rcu_waiting_batch;
+  cpu->rcu_waiting_batch = 0;
+
+  while (0 != head)
+  {
+   register struct rcu_head* const next = head->next;
+   head->function(head);
+   head = next;
+  }
+ }
+
+ if (0 == cpu->rcu_next_batch)
+  return;
+
+ /* Start a grace period for the callbacks queued since the last one. */
+ cpu->rcu_waiting_batch = cpu->rcu_next_batch;
+ cpu->rcu_next_batch = 0;
+
+ for(i=0; i<number_of_available_CPUs; i++)
+  cpu->rcu_snapshot[i] = CPU_private_table[i].quiescent_state_count;
+}
+
+int
+rcu_callbacks_pending(void)
+{
+ register const struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ return (0 != cpu->rcu_waiting_batch) || (0 != cpu->rcu_next_batch);
+}
@@ -0,0 +1,63 @@
+/*! \file rcu.h
+    \brief Holds declarations for read-copy-update. */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include "kernel.h"
+
+/*! Defines a callback waiting for a grace period. The structure is embedded
+    in the object the callback reclaims. */
+struct rcu_head
+{
+ struct rcu_head* next;                        /*!< The next callback in
+                                                    the same batch. */
+ void           (*function)(struct rcu_head*); /*!< The function to call
+                                                    when the grace period
+                                                    has elapsed. */
+};
+
+/*! Starts a read-side critical section. Readers may use the objects they
+    find until rcu_read_unlock without taking any locks. The kernel is not
+    preemptive and runs with interrupts disabled so this is only a compiler
+    barrier that keeps loads inside the critical section.
+
+    Kernel code must never block, or otherwise give up the CPU, inside a
+    read-side critical section. That is what lets a clock tick count as a
+    quiescent state for the CPU taking it: the tick cannot arrive while the
+    CPU is in a critical section. It is also why a system with a single CPU
+    can treat every tick as the end of a grace period. */
+inline static void
+rcu_read_lock(void)
+{
+ __asm volatile("" : : : "memory");
+}
+
+/*! Ends a read-side critical section. */
+inline static void
+rcu_read_unlock(void)
+{
+ __asm volatile("" : : : "memory");
+}
+
+/*! Calls a function once all CPUs have passed a quiescent state, that is
+    when no reader can still use an object unlinked before the call. The
+    function is called from the timer interrupt of the calling CPU. */
+extern void
+call_rcu(struct rcu_head* const head
+          /*!< The callback structure embedded in the object. */,
+         void (* const function)(struct rcu_head*)
+          /*!< The function to call. */);
+
+/*! Advances the grace period machinery of the calling CPU and runs the
+    callbacks whose grace period has elapsed. Called at every clock tick on
+    every CPU. */
+extern void
+rcu_tick(void);
+
+/*! Checks if the calling CPU has callbacks waiting for a grace period.
+    \returns 1 if there are callbacks and 0 otherwise. */
+extern int
+rcu_callbacks_pending(void);
+
+#endif
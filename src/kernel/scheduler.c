@@ -1,17 +1,1124 @@
 /*!
  * \file scheduler.c
  * \brief
- *  This file holds the scheduler code. 
+ *  This file holds the scheduler code.
+ *
+ *  The scheduler is a preemptive priority scheduler with multi-level feedback.
+ *  Every thread has a fixed priority, set through SYSCALL_SETPRIORITY, between
+ *  0 (highest) and NUMBER_OF_PRIORITY_LEVELS-1 (lowest). Threads with a higher
+ *  priority always run before threads with a lower priority.
+ *
+ *  On top of the fixed priority a thread that uses up its quantum is demoted
+ *  one level, up to NUMBER_OF_FEEDBACK_LEVELS-1 levels, below its fixed
+ *  priority. Threads on demoted levels get longer quanta. A thread which
+ *  blocks before its quantum is used up keeps its level. This way threads
+ *  doing I/O or IPC get low latency while CPU bound threads sink. To avoid
+ *  starvation all demotions of ready threads are periodically undone.
+ *
+ *  Every CPU has its own set of ready queues, one per priority level, in its
+ *  CPU_private structure. A bitmap with one bit per level tells which queues
+ *  are non-empty so that the best thread is found in constant time with a
+ *  single bit scan. A CPU only touches its own ready queues when it
+ *  dispatches threads. A CPU which runs out of work steals a thread from the
+ *  CPU with the most ready threads. This way the ready queue locks are, in
+ *  the common case, only taken by the CPU owning them.
+ *
+ *  CPU time is shared between processes, not threads, with stride
+ *  scheduling. Every process has a weight and a pass. The pass of a process
+ *  is advanced by STRIDE_ONE divided by the weight for every clock tick one
+ *  of its threads runs. Among the ready threads on the highest non-empty
+ *  level of a CPU the thread belonging to the process with the lowest pass
+ *  runs first. Each level is kept sorted by the pass the process had when
+ *  the thread was made ready so this thread is found at the head. A process
+ *  which has not been running for a while has its pass moved up close to
+ *  the pass of the processes that have been running so that it does not
+ *  monopolize the CPU when it wakes up. A thread of the process which ran
+ *  last on the CPU is preferred if it is among the first few threads of the
+ *  level and its process is at most ADDRESS_SPACE_PASS_SLACK behind in pass.
+ *  The switch then does not need to reload cr3 and the TLB entries of the
+ *  process survive.
+ *
+ *  Realtime threads, moved into the realtime class by SYSCALL_SETREALTIME,
+ *  are scheduled earliest deadline first and always run before the
+ *  best-effort threads described above. A realtime thread has a period, a
+ *  budget and a relative deadline. It is admitted on, and bound to, a CPU
+ *  only if the sum of budget divided by deadline over the realtime threads
+ *  of the CPU stays below MAX_REALTIME_UTILIZATION. Every CPU keeps its
+ *  ready realtime threads in a queue sorted by absolute deadline. A realtime
+ *  thread which uses up its budget is put in the timer wheel until its next
+ *  period starts, so a misbehaving thread cannot take more than its share.
+ *
+ *  Every CPU keeps statistics in its CPU_private structure: the number of
+ *  context switches and log2 histograms of the time, measured with the time
+ *  stamp counter, from when a thread is made ready until it runs and of the
+ *  number of ready threads sampled at every clock tick. They are read
+ *  through SYSCALL_GETSCHEDULERSTATISTICS.
+ *
+ *  Synchronous IPC bypasses the ready queues. A thread sending to a thread
+ *  blocked in a receive, or replying to a thread blocked in a call, hands
+ *  its CPU directly to that thread through hand_off_CPU or directed_yield.
+ *
+ *  Threads made ready are inserted into the ready queues of the CPU they
+ *  last ran on so that they find their working set in the caches and TLB
+ *  of that CPU. Every thread has an affinity mask which restricts the CPUs
+ *  it may be placed on or stolen by.
+ *
+ *  Only the BSP gets the PIT clock ticks. The application processors tick
+ *  with their local APIC timers while they run threads. An idle CPU sets its
+ *  bit in idle_CPU_bitmap and halts. An idle application processor only arms
+ *  its timer for the next thread due in its own timer wheel, see timer.c, and
+ *  otherwise stops it altogether. A CPU which makes a thread ready sends a
+ *  wakeup IPI to the CPU the thread is placed on if that CPU is idle or runs
+ *  a thread with a lower priority. If the CPU is busy an idle CPU allowed to
+ *  run the thread is woken so that it can steal the thread. This way threads
+ *  woken by IPC or timers start running without waiting for the next clock
+ *  tick.
  */
 
 #include "kernel.h"
+#include "threadqueue.h"
+#include "mm.h"
+#include "timer.h"
+#include "rcu.h"
+
+#define PRIORITY_BOOST_INTERVAL_TICKS (200)
+/*!< The number of timer ticks between two priority boosts. */
+
+#define ADDRESS_SPACE_PASS_SLACK (STRIDE_ONE/DEFAULT_PROCESS_WEIGHT)
+/*!< How far, in pass, a thread sharing the page table tree of the previous
+     thread on the CPU may be behind the fairest thread and still be picked
+     before it. */
+
+#define ADDRESS_SPACE_SEARCH_LENGTH (4)
+/*!< The number of threads at the head of a ready queue searched for a
+     thread sharing the page table tree of the previous thread. */
+
+/*! The quantum, in timer ticks, for each feedback level. */
+static const int
+quantum_ticks[NUMBER_OF_FEEDBACK_LEVELS] = {1, 2, 4, 8};
+
+static volatile unsigned long
+global_pass = 0;
+/*!< The highest pass of any dispatched process. It approximates the virtual
+     time of the running processes. It is only used as a hint and is updated
+     without any locks. */
+
+/*! Wrapper for the bsf instruction.
+    \returns The index of the least significant set bit. The bitmap must not
+             be zero. */
+inline static int
+find_first_set_bit(const register unsigned long bitmap
+                   /*!< The bitmap to scan. */)
+{
+ register unsigned long bit_index;
+ __asm ("bsfq %1,%0" : "=r" (bit_index) : "rm" (bitmap));
+ return bit_index;
+}
+
+/*! Calculates the histogram bucket a value is counted in.
+    \returns 0 for 0, otherwise one more than the index of the most
+             significant set bit, limited to the last bucket. */
+inline static int
+histogram_bucket(const register unsigned long value
+                 /*!< The value to count. */)
+{
+ register unsigned long bit_index;
+
+ if (0 == value)
+  return 0;
+
+ __asm ("bsrq %1,%0" : "=r" (bit_index) : "rm" (value));
+
+ if (bit_index+1 >= SCHEDULER_HISTOGRAM_BUCKETS)
+  return SCHEDULER_HISTOGRAM_BUCKETS-1;
+
+ return bit_index+1;
+}
+
+/*! Calculates the level of the ready queue a thread belongs in.
+    \returns The fixed priority of the thread plus its demotion, limited to
+             the lowest priority level. */
+inline static int
+effective_priority(const register int thread_index
+                   /*!< Index, into thread_table, of the thread. */)
+{
+ register int level = thread_table[thread_index].data.priority +
+                      thread_table[thread_index].data.feedback_level;
+
+ if (level >= NUMBER_OF_PRIORITY_LEVELS)
+  level = NUMBER_OF_PRIORITY_LEVELS-1;
+
+ return level;
+}
+
+/*! Checks if a thread is in the realtime class.
+    \returns 1 if the thread is a realtime thread and 0 otherwise. */
+inline static int
+is_realtime_thread(const register int thread_index
+                   /*!< Index, into thread_table, of the thread. */)
+{
+ return 0 != thread_table[thread_index].data.realtime_period;
+}
+
+/*! Checks if a thread should preempt the thread running on a CPU.
+    \returns 1 if the CPU is idle, if the thread is a realtime thread and the
+             running thread is a best-effort thread or has a later deadline,
+             or if both are best-effort threads and the thread has a higher
+             priority. Returns 0 otherwise. */
+static int
+thread_preempts(const register int thread_index
+                /*!< Index, into thread_table, of the thread. */,
+                const register int running_thread_index
+                /*!< Index, into thread_table, of the running thread or -1 if
+                     the CPU is idle. */)
+{
+ if (-1 == running_thread_index)
+  return 1;
+
+ if (is_realtime_thread(thread_index))
+  return !is_realtime_thread(running_thread_index) ||
+         (thread_table[thread_index].data.absolute_deadline <
+          thread_table[running_thread_index].data.absolute_deadline);
+
+ return !is_realtime_thread(running_thread_index) &&
+        (effective_priority(thread_index) <
+         effective_priority(running_thread_index));
+}
+
+/*! Inserts a realtime thread into the realtime queue of a CPU after all
+    threads with an earlier, or the same, absolute deadline. The caller must
+    hold the ready queue lock of the CPU. */
+static void
+enqueue_realtime_thread_locked(register struct CPU_private* const cpu
+                               /*!< The CPU whose realtime queue the thread is
+                                    inserted into. */,
+                               const register int thread_index
+                               /*!< Index, into thread_table, of the
+                                    thread. */)
+{
+ register const long deadline =
+  thread_table[thread_index].data.absolute_deadline;
+ register int previous_thread_index = -1;
+ register int next_thread_index = thread_queue_head(&cpu->realtime_queue);
+
+ while((-1 != next_thread_index) &&
+       (thread_table[next_thread_index].data.absolute_deadline <= deadline))
+ {
+  previous_thread_index = next_thread_index;
+  next_thread_index = thread_table[next_thread_index].data.next;
+ }
+
+ thread_table[thread_index].data.next = next_thread_index;
+ if (-1 == previous_thread_index)
+  cpu->realtime_queue.head = thread_index;
+ else
+  thread_table[previous_thread_index].data.next = thread_index;
+ if (-1 == next_thread_index)
+  cpu->realtime_queue.tail = thread_index;
+}
+
+/*! Inserts a thread into a ready queue after all threads whose process had
+    a lower, or the same, pass when they were inserted. The pass of a process
+    only grows so the thread normally goes at the tail, which is checked
+    first. The caller must hold the ready queue lock. */
+static void
+enqueue_by_pass_locked(register struct thread_queue* const queue
+                       /*!< The ready queue the thread is inserted into. */,
+                       const register int thread_index
+                       /*!< Index, into thread_table, of the thread. */)
+{
+ register const unsigned long pass =
+  process_table[thread_table[thread_index].data.owner].pass;
+ register int previous_thread_index = -1;
+ register int next_thread_index = thread_queue_head(queue);
+
+ thread_table[thread_index].data.ready_pass = pass;
+
+ if ((-1 == queue->tail) ||
+     (thread_table[queue->tail].data.ready_pass <= pass))
+ {
+  thread_queue_enqueue(queue, thread_index);
+  return;
+ }
+
+ while(thread_table[next_thread_index].data.ready_pass <= pass)
+ {
+  previous_thread_index = next_thread_index;
+  next_thread_index = thread_table[next_thread_index].data.next;
+ }
+
+ thread_table[thread_index].data.next = next_thread_index;
+ if (-1 == previous_thread_index)
+  queue->head = thread_index;
+ else
+  thread_table[previous_thread_index].data.next = thread_index;
+}
+
+/*! Inserts a thread into the ready queue, matching its priority, of a CPU.
+    Realtime threads are inserted into the realtime queue instead. The
+    caller must hold the ready queue lock of the CPU. */
+static void
+enqueue_ready_thread_locked(register struct CPU_private* const cpu
+                            /*!< The CPU whose ready queues the thread is
+                                 inserted into. */,
+                            const register int thread_index
+                            /*!< Index, into thread_table, of the thread. */)
+{
+ register const int level = effective_priority(thread_index);
+
+ if (is_realtime_thread(thread_index))
+ {
+  enqueue_realtime_thread_locked(cpu, thread_index);
+  return;
+ }
+
+ enqueue_by_pass_locked(&cpu->ready_queue[level], thread_index);
+ cpu->ready_queue_bitmap |= 1UL << level;
+ cpu->ready_queue_length++;
+}
+
+/*! Inserts a thread into the ready queue, matching the priority of the
+    thread, of a CPU. */
+static void
+enqueue_ready_thread(register struct CPU_private* const cpu
+                     /*!< The CPU whose ready queues the thread is inserted
+                          into. */,
+                     const register int thread_index
+                     /*!< Index, into thread_table, of the thread. */)
+{
+ grab_lock_rw(&cpu->ready_queue_lock);
+ enqueue_ready_thread_locked(cpu, thread_index);
+ release_lock(&cpu->ready_queue_lock);
+}
+
+/*! Removes, from a ready queue, the thread belonging to the process with
+    the lowest pass. The queue is sorted by pass so this is the head. A
+    thread using the page table tree given is removed instead if it is among
+    the first ADDRESS_SPACE_SEARCH_LENGTH threads and its process is behind
+    by no more than ADDRESS_SPACE_PASS_SLACK. The caller must hold the ready
+    queue lock and the queue must not be empty.
+    \returns The index, into thread_table, of the removed thread. */
+static int
+dequeue_fairest_thread(register struct thread_queue* const queue
+                       /*!< The ready queue to remove a thread from. */,
+                       const register unsigned long page_table_root
+                       /*!< The page table tree currently in use. */)
+{
+ register const int     head_thread_index = thread_queue_head(queue);
+ register const unsigned long max_pass =
+  thread_table[head_thread_index].data.ready_pass + ADDRESS_SPACE_PASS_SLACK;
+ register int           previous_thread_index = -1;
+ register int           thread_index = head_thread_index;
+ register int           i;
+
+ for(i=0;
+     (i < ADDRESS_SPACE_SEARCH_LENGTH) && (-1 != thread_index) &&
+     (thread_table[thread_index].data.ready_pass <= max_pass);
+     i++)
+ {
+  if (page_table_root ==
+      process_table[thread_table[thread_index].data.owner].page_table_root)
+   break;
+
+  previous_thread_index = thread_index;
+  thread_index = thread_table[thread_index].data.next;
+ }
+
+ if ((i == ADDRESS_SPACE_SEARCH_LENGTH) || (-1 == thread_index) ||
+     (thread_table[thread_index].data.ready_pass > max_pass) ||
+     (-1 == previous_thread_index))
+  return thread_queue_dequeue(queue);
+
+ /* Unlink the thread sharing the page table tree. */
+ thread_table[previous_thread_index].data.next =
+  thread_table[thread_index].data.next;
+ if (queue->tail == thread_index)
+  queue->tail = previous_thread_index;
+ return thread_index;
+}
+
+/*! Removes the fairest thread on the highest non-empty priority level of a
+    CPU. Only levels with a higher priority than max_level, or equal to it,
+    are considered.
+    \returns The index, into thread_table, of the removed thread or -1 if no
+             thread was found. */
+static int
+dequeue_ready_thread(register struct CPU_private* const cpu
+                     /*!< The CPU whose ready queues a thread is removed
+                          from. */,
+                     const register int max_level
+                     /*!< The lowest priority level to look at. */)
+{
+ register int thread_index = -1;
+
+ /* Avoid taking the lock if there is obviously nothing to do. */
+ if ((0 == cpu->ready_queue_bitmap) ||
+     (find_first_set_bit(cpu->ready_queue_bitmap) > max_level))
+  return -1;
+
+ grab_lock_rw(&cpu->ready_queue_lock);
+ if (0 != cpu->ready_queue_bitmap)
+ {
+  register const int level = find_first_set_bit(cpu->ready_queue_bitmap);
+
+  if (level <= max_level)
+  {
+   thread_index = dequeue_fairest_thread(&cpu->ready_queue[level],
+                                         cpu->page_table_root);
+   if (thread_queue_is_empty(&cpu->ready_queue[level]))
+    cpu->ready_queue_bitmap &= ~(1UL << level);
+   cpu->ready_queue_length--;
+  }
+ }
+ release_lock(&cpu->ready_queue_lock);
+
+ return thread_index;
+}
+
+/*! Removes the realtime thread with the earliest deadline from a CPU.
+    \returns The index, into thread_table, of the removed thread or -1 if the
+             CPU has no ready realtime threads. */
+static int
+dequeue_realtime_thread(register struct CPU_private* const cpu
+                        /*!< The CPU whose realtime queue a thread is removed
+                             from. */)
+{
+ register int thread_index;
+
+ /* Avoid taking the lock if there is obviously nothing to do. */
+ if (thread_queue_is_empty(&cpu->realtime_queue))
+  return -1;
+
+ grab_lock_rw(&cpu->ready_queue_lock);
+ thread_index = thread_queue_dequeue(&cpu->realtime_queue);
+ release_lock(&cpu->ready_queue_lock);
+
+ return thread_index;
+}
+
+/*! Removes a ready thread which should preempt the thread running on a
+    CPU.
+    \returns The index, into thread_table, of the removed thread or -1 if no
+             ready thread should preempt the running thread. */
+static int
+dequeue_preempting_thread(register struct CPU_private* const cpu
+                          /*!< The CPU whose ready queues a thread is
+                               removed from. */,
+                          const register int running_thread_index
+                          /*!< Index, into thread_table, of the running
+                               thread. */)
+{
+ register int thread_index = -1;
+ register int level;
+
+ if (!thread_queue_is_empty(&cpu->realtime_queue))
+ {
+  grab_lock_rw(&cpu->ready_queue_lock);
+  thread_index = thread_queue_head(&cpu->realtime_queue);
+  if ((-1 != thread_index) &&
+      thread_preempts(thread_index, running_thread_index))
+   thread_queue_dequeue(&cpu->realtime_queue);
+  else
+   thread_index = -1;
+  release_lock(&cpu->ready_queue_lock);
+
+  if (-1 != thread_index)
+   return thread_index;
+ }
+
+ /* Best-effort threads never preempt realtime threads. */
+ if (is_realtime_thread(running_thread_index))
+  return -1;
+
+ level = effective_priority(running_thread_index);
+ if (0 == level)
+  return -1;
+
+ return dequeue_ready_thread(cpu, level-1);
+}
+
+/*! Removes the first thread, which is allowed to run on the thief CPU, on
+    the highest non-empty priority level of a CPU.
+    \returns The index, into thread_table, of the removed thread or -1 if no
+             thread was found. */
+static int
+dequeue_allowed_thread(register struct CPU_private* const cpu
+                       /*!< The CPU whose ready queues a thread is removed
+                            from. */,
+                       const register int thief
+                       /*!< Index of the CPU the thread is to run on. */)
+{
+ register int           thread_index = -1;
+ register unsigned long bitmap;
+
+ grab_lock_rw(&cpu->ready_queue_lock);
+ for(bitmap = cpu->ready_queue_bitmap; 0 != bitmap; bitmap &= bitmap-1)
+ {
+  register const int level = find_first_set_bit(bitmap);
+
+  for(thread_index = thread_queue_head(&cpu->ready_queue[level]);
+      -1 != thread_index;
+      thread_index = thread_table[thread_index].data.next)
+  {
+   if (0 != (thread_table[thread_index].data.affinity_mask & (1UL<<thief)))
+    break;
+  }
+
+  if (-1 != thread_index)
+  {
+   thread_queue_remove(&cpu->ready_queue[level], thread_index);
+   if (thread_queue_is_empty(&cpu->ready_queue[level]))
+    cpu->ready_queue_bitmap &= ~(1UL << level);
+   cpu->ready_queue_length--;
+   break;
+  }
+ }
+ release_lock(&cpu->ready_queue_lock);
+
+ return thread_index;
+}
+
+/*! Undoes the demotion of all threads in the ready queues of a CPU. */
+static void
+boost_ready_threads(register struct CPU_private* const cpu
+                    /*!< The CPU whose ready threads are boosted. */)
+{
+ struct thread_queue boosted_threads;
+ register int        thread_index;
+
+ thread_queue_init(&boosted_threads);
+
+ grab_lock_rw(&cpu->ready_queue_lock);
+
+ /* Empty the ready queues in priority order and then reinsert the threads.
+    This keeps the order between threads on the same level. */
+ while(0 != cpu->ready_queue_bitmap)
+ {
+  register const int level = find_first_set_bit(cpu->ready_queue_bitmap);
+
+  while(-1 != (thread_index = thread_queue_dequeue(&cpu->ready_queue[level])))
+   thread_queue_enqueue(&boosted_threads, thread_index);
+
+  cpu->ready_queue_bitmap &= ~(1UL << level);
+ }
+ cpu->ready_queue_length = 0;
+
+ while(-1 != (thread_index = thread_queue_dequeue(&boosted_threads)))
+ {
+  thread_table[thread_index].data.feedback_level = 0;
+  enqueue_ready_thread_locked(cpu, thread_index);
+ }
+
+ release_lock(&cpu->ready_queue_lock);
+}
+
+/*! Steals a thread from the ready queues of another CPU. The CPU with the
+    most ready threads is chosen as victim.
+    \returns The index, into thread_table, of the stolen thread or -1 if
+             no thread could be stolen. */
+static int
+steal_ready_thread(const register int thief
+                   /*!< Index of the CPU looking for work. */)
+{
+ register int i;
+ register int victim = -1;
+ register int victim_length = 0;
+
+ /* Start the scan at the next CPU so that idle CPUs do not all pick the
+    same victim when the queue lengths are equal. The lengths are read without
+    taking any locks. They are only used as hints. */
+ for(i=1; i<number_of_available_CPUs; i++)
+ {
+  register int candidate = (thief+i) % number_of_available_CPUs;
+  register int length = CPU_private_table[candidate].ready_queue_length;
+
+  if (length > victim_length)
+  {
+   victim = candidate;
+   victim_length = length;
+  }
+ }
+
+ if (-1 == victim)
+  return -1;
+
+ return dequeue_allowed_thread(&CPU_private_table[victim], thief);
+}
+
+/*! Selects the CPU a thread is made ready on.
+    \returns The CPU the thread last ran on if the thread is allowed to run
+             there. Otherwise the allowed CPU with the fewest ready threads
+             where idle CPUs and then the calling CPU win ties. */
+static int
+select_CPU_for_thread(const register int thread_index
+                      /*!< Index, into thread_table, of the thread. */)
+{
+ register const unsigned long affinity_mask =
+  thread_table[thread_index].data.affinity_mask;
+ register const int last_CPU = thread_table[thread_index].data.last_CPU;
+ register const int self = get_processor_index();
+ register int       best_CPU = -1;
+ register int       best_length = 0;
+ register int       best_is_idle = 0;
+ register int       i;
+
+ if ((-1 != last_CPU) && (0 != (affinity_mask & (1UL<<last_CPU))))
+  return last_CPU;
+
+ for(i=0; i<number_of_available_CPUs; i++)
+ {
+  register const int candidate = (self+i) % number_of_available_CPUs;
+  register const int length = CPU_private_table[candidate].ready_queue_length;
+  register const int is_idle = (0 != (idle_CPU_bitmap & (1UL<<candidate)));
+
+  if ((0 != (affinity_mask & (1UL<<candidate))) &&
+      ((-1 == best_CPU) ||
+       (length < best_length) ||
+       ((length == best_length) && (is_idle > best_is_idle))))
+  {
+   best_CPU = candidate;
+   best_length = length;
+   best_is_idle = is_idle;
+  }
+ }
+
+ /* The affinity mask is checked when it is set so this should not happen. */
+ if (-1 == best_CPU)
+  best_CPU = self;
+
+ return best_CPU;
+}
+
+/*! Selects the next thread to run on the CPU. The local realtime queue is
+    tried first and then the local ready queues.
+    \returns The index, into thread_table, of the selected thread or -1 if
+             there is no thread ready to run. */
+static int
+select_next_thread(register struct CPU_private* const cpu
+                   /*!< The CPU to find a thread for. */)
+{
+ register int thread_index = dequeue_realtime_thread(cpu);
+
+ if (-1 == thread_index)
+  thread_index = dequeue_ready_thread(cpu, NUMBER_OF_PRIORITY_LEVELS-1);
+
+ if (-1 == thread_index)
+  thread_index = steal_ready_thread(cpu->CPU_index);
+
+ return thread_index;
+}
+
+/*! Lets a thread run on the calling CPU. A thread index of -1 makes the CPU
+    idle. The local APIC timer of an application processor is set to tick
+    while a thread runs. When the CPU is idle it is set to fire when the
+    next thread in the local timer wheel is due or is stopped if there is
+    none. */
+static void
+dispatch_thread(register struct CPU_private* const cpu
+                /*!< The CPU to dispatch the thread on. */,
+                const register int thread_index
+                /*!< Index, into thread_table, of the thread to run. */)
+{
+ if ((-1 != thread_index) && (cpu->thread_index != thread_index))
+  cpu->statistics.context_switches++;
+
+ cpu->thread_index = thread_index;
+
+ if (0 != cpu->CPU_index)
+ {
+  if (-1 == thread_index)
+  {
+   register const long ticks_until_expiry =
+    timer_wheel_ticks_until_next_expiry();
+
+   /* The idle loop runs on the kernel page table tree. Keep page_table_root
+      in step so that no idle CPU prefers the threads of some process. */
+   cpu->page_table_root = kernel_page_table_root;
+
+   /* Only wake up for the threads sleeping in the local timer wheel and to
+      finish the grace periods of the CPU. */
+   cpu->local_timer_is_periodic = 0;
+   if (rcu_callbacks_pending())
+    start_one_shot_local_timer(1);
+   else if (-1 == ticks_until_expiry)
+    stop_local_timer();
+   else
+    start_one_shot_local_timer((ticks_until_expiry > 0) ?
+                               ticks_until_expiry : 1);
+  }
+  else if (!cpu->local_timer_is_periodic)
+  {
+   cpu->local_timer_is_periodic = 1;
+   start_periodic_local_timer();
+  }
+ }
+
+ if (-1 != thread_index)
+ {
+  register const unsigned long CPU_bit = 1UL<<cpu->CPU_index;
+
+  if (0 != (idle_CPU_bitmap & CPU_bit))
+   lock_and(&idle_CPU_bitmap, ~CPU_bit);
+
+  /* Only count the wait after a wakeup, not after a preemption. */
+  if (0 != thread_table[thread_index].data.ready_timestamp)
+  {
+   cpu->statistics.wakeup_latency_histogram[histogram_bucket(
+    read_time_stamp_counter() -
+    thread_table[thread_index].data.ready_timestamp)]++;
+   thread_table[thread_index].data.ready_timestamp = 0;
+  }
+
+  /* Keep track of how often threads move between CPUs. */
+  if ((-1 != thread_table[thread_index].data.last_CPU) &&
+      (cpu->CPU_index != thread_table[thread_index].data.last_CPU))
+   thread_table[thread_index].data.migrations++;
+  thread_table[thread_index].data.last_CPU = cpu->CPU_index;
+
+  cpu->ticks_left_of_time_slice =
+   quantum_ticks[thread_table[thread_index].data.feedback_level];
+  cpu->page_table_root =
+   process_table[thread_table[thread_index].data.owner].page_table_root;
+
+  if (process_table[thread_table[thread_index].data.owner].pass > global_pass)
+   global_pass = process_table[thread_table[thread_index].data.owner].pass;
+ }
+}
+
+/*! Charges the process of a running thread for a clock tick. */
+static void
+charge_process(const register int thread_index
+               /*!< Index, into thread_table, of the running thread. */)
+{
+ register struct process* const process =
+  &process_table[thread_table[thread_index].data.owner];
+
+ /* Threads of the same process may run on several CPUs at once. */
+ lock_add(&process->consumed_ticks, 1);
+ lock_add(&process->pass, process->stride);
+}
+
+/*! Moves the pass of the process of a thread being made ready up to one
+    stride behind global_pass. This limits the credit a process can build up
+    while all its threads are blocked. */
+static void
+limit_process_credit(const register int thread_index
+                     /*!< Index, into thread_table, of the thread. */)
+{
+ register struct process* const process =
+  &process_table[thread_table[thread_index].data.owner];
+ register const unsigned long minimum_pass = global_pass - process->stride;
+
+ /* A racing charge_process may be lost. This only costs the process a tick
+    of accounting. */
+ if ((global_pass > process->stride) && (process->pass < minimum_pass))
+  process->pass = minimum_pass;
+}
+
+/*! Finds a thread for the calling CPU and dispatches it. If no thread is
+    found the CPU is marked idle. */
+static void
+dispatch_next_thread(register struct CPU_private* const cpu
+                     /*!< The CPU to dispatch a thread on. */)
+{
+ register int thread_index = select_next_thread(cpu);
+
+ if (-1 == thread_index)
+ {
+  /* Announce that the CPU is idle before looking once more. A thread made
+     ready after the first look is then either found here or the CPU making
+     it ready sees the idle bit and sends a wakeup IPI. */
+  lock_or(&idle_CPU_bitmap, 1UL<<cpu->CPU_index);
+  thread_index = select_next_thread(cpu);
+ }
+
+ dispatch_thread(cpu, thread_index);
+}
+
+/*! Sends a wakeup IPI to an idle CPU, other than the calling CPU, which is
+    allowed by the affinity mask. Nothing is sent if there is no such CPU. */
+static void
+wake_idle_CPU(const register unsigned long affinity_mask
+              /*!< The CPUs which may be woken. */)
+{
+ register const unsigned long candidates = idle_CPU_bitmap & affinity_mask &
+                                           ~(1UL<<get_processor_index());
+
+ if (0 != candidates)
+  send_IPI(find_first_set_bit(candidates), WAKEUP_IPI_VECTOR);
+}
+
+void
+make_thread_ready(const int thread_index)
+{
+ register int CPU_index;
+ register struct CPU_private* cpu;
+ register int running_thread_index;
+
+ /* A realtime thread which has been blocked past its deadline starts a new
+    period now. Otherwise it would keep a deadline in the past, which EDF
+    would always pick first, and the budget left from before it blocked. */
+ if (is_realtime_thread(thread_index) &&
+     (thread_table[thread_index].data.absolute_deadline <= system_time))
+ {
+  register union thread* const thread = &thread_table[thread_index];
+
+  thread->data.absolute_deadline = system_time +
+                                   thread->data.realtime_deadline;
+  thread->data.budget_left = thread->data.realtime_budget;
+  thread->data.next_release = system_time + thread->data.realtime_period;
+ }
+
+ CPU_index = select_CPU_for_thread(thread_index);
+ cpu = &CPU_private_table[CPU_index];
+
+ limit_process_credit(thread_index);
+ thread_table[thread_index].data.ready_timestamp = read_time_stamp_counter();
+
+ /* An idle CPU can start running the thread at once. Only the CPU itself
+    may change which thread it runs. */
+ if (get_processor_index() == CPU_index)
+ {
+  if (-1 == cpu->thread_index)
+   dispatch_thread(cpu, thread_index);
+  else
+   enqueue_ready_thread(cpu, thread_index);
+  return;
+ }
+
+ enqueue_ready_thread(cpu, thread_index);
+
+ /* The enqueue must be visible before the idle bitmap is read. The CPU
+    going idle sets its bit with a locked instruction and then looks at its
+    ready queues, so without a full fence here both could miss the other.
+    Releasing the ready queue lock does not order them as the lock may be
+    handed to a waiting CPU with a plain store. */
+ __asm volatile("mfence" : : : "memory");
+ if (0 != (idle_CPU_bitmap & (1UL<<CPU_index)))
+ {
+  send_IPI(CPU_index, WAKEUP_IPI_VECTOR);
+  return;
+ }
+
+ /* The CPU is busy. Preempt the running thread if the new thread should
+    run before it. Otherwise let an idle CPU steal the thread. Realtime
+    threads are bound to their CPU and are never stolen. */
+ running_thread_index = cpu->thread_index;
+ if ((-1 != running_thread_index) &&
+     thread_preempts(thread_index, running_thread_index))
+  send_IPI(CPU_index, WAKEUP_IPI_VECTOR);
+ else if (!is_realtime_thread(thread_index))
+  wake_idle_CPU(thread_table[thread_index].data.affinity_mask);
+}
+
+/*! Calculates the utilization a realtime thread reserves.
+    \returns The budget divided by the deadline scaled by
+             REALTIME_UTILIZATION_SCALE. */
+inline static unsigned long
+realtime_utilization(const register long budget
+                     /*!< The budget in clock ticks. */,
+                     const register long deadline
+                     /*!< The relative deadline in clock ticks. */)
+{
+ return (budget*REALTIME_UTILIZATION_SCALE)/deadline;
+}
+
+int
+set_realtime_parameters(const int  thread_index,
+                        const long period,
+                        const long budget,
+                        long       deadline)
+{
+ register union thread* const thread = &thread_table[thread_index];
+ register const int self = get_processor_index();
+ register int       old_CPU = -1;
+ register unsigned long old_utilization = 0;
+ register unsigned long utilization;
+ register unsigned long allowed_CPUs = thread->data.affinity_mask;
+ register int       i;
+
+ if (is_realtime_thread(thread_index))
+ {
+  old_CPU = thread->data.last_CPU;
+  old_utilization = realtime_utilization(thread->data.realtime_budget,
+                                         thread->data.realtime_deadline);
+  /* The thread is bound to old_CPU. It may move to any CPU it was allowed
+     on before it was admitted. */
+  allowed_CPUs = thread->data.saved_affinity_mask;
+ }
+
+ /* Leave the realtime class. Threads in the best-effort class are left as
+    they are. */
+ if (0 == period)
+ {
+  if (-1 != old_CPU)
+  {
+   grab_lock_rw(&CPU_private_table[old_CPU].ready_queue_lock);
+   CPU_private_table[old_CPU].realtime_utilization -= old_utilization;
+   release_lock(&CPU_private_table[old_CPU].ready_queue_lock);
+
+   thread->data.realtime_period = 0;
+   thread->data.affinity_mask = thread->data.saved_affinity_mask;
+  }
+  return self;
+ }
+
+ if (0 == deadline)
+  deadline = period;
+
+ if ((budget <= 0) || (budget > deadline) || (deadline > period))
+  return -1;
+
+ /* Admit the thread on the first CPU, starting with the calling CPU, where
+    it fits. Deadlines shorter than the period are accounted for by using
+    budget divided by deadline as utilization. This is a sufficient test
+    for EDF. */
+ utilization = realtime_utilization(budget, deadline);
+ for(i=0; i<number_of_available_CPUs; i++)
+ {
+  register const int candidate = (self+i) % number_of_available_CPUs;
+  register struct CPU_private* const cpu = &CPU_private_table[candidate];
+  register int admitted = 0;
+
+  if (0 == (allowed_CPUs & (1UL<<candidate)))
+   continue;
+
+  grab_lock_rw(&cpu->ready_queue_lock);
+  if ((cpu->realtime_utilization + utilization -
+       ((candidate == old_CPU) ? old_utilization : 0)) <=
+      MAX_REALTIME_UTILIZATION)
+  {
+   cpu->realtime_utilization += utilization;
+   if (candidate == old_CPU)
+    cpu->realtime_utilization -= old_utilization;
+   admitted = 1;
+  }
+  release_lock(&cpu->ready_queue_lock);
+
+  if (!admitted)
+   continue;
+
+  if ((-1 != old_CPU) && (candidate != old_CPU))
+  {
+   grab_lock_rw(&CPU_private_table[old_CPU].ready_queue_lock);
+   CPU_private_table[old_CPU].realtime_utilization -= old_utilization;
+   release_lock(&CPU_private_table[old_CPU].ready_queue_lock);
+  }
+
+  /* The first period starts now. */
+  thread->data.realtime_budget = budget;
+  thread->data.realtime_deadline = deadline;
+  thread->data.budget_left = budget;
+  thread->data.absolute_deadline = system_time + deadline;
+  thread->data.next_release = system_time + period;
+  thread->data.saved_affinity_mask = allowed_CPUs;
+  thread->data.affinity_mask = 1UL<<candidate;
+  thread->data.last_CPU = candidate;
+  thread->data.realtime_period = period;
+  return candidate;
+ }
+
+ return -1;
+}
+
+void
+start_next_period(const int thread_index)
+{
+ register union thread* const thread = &thread_table[thread_index];
+ register long release = thread->data.next_release;
+
+ /* A thread which has fallen behind starts its next period now instead of
+    catching up on the periods it missed. */
+ if (release < system_time)
+  release = system_time;
+
+ thread->data.next_release = release + thread->data.realtime_period;
+ thread->data.absolute_deadline = release + thread->data.realtime_deadline;
+ thread->data.budget_left = thread->data.realtime_budget;
+
+ if (release > system_time)
+  timer_wheel_insert(thread_index, release - system_time);
+ else
+  make_thread_ready(thread_index);
+}
+
+void
+scheduler_called_from_wakeup_IPI_handler(void)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+ register const int current_thread_index = cpu->thread_index;
+ register int next_thread_index;
+
+ if (-1 == current_thread_index)
+ {
+  dispatch_next_thread(cpu);
+  return;
+ }
+
+ /* A thread which should run before the running thread may have been
+    made ready on this CPU. */
+ next_thread_index = dequeue_preempting_thread(cpu, current_thread_index);
+ if (-1 == next_thread_index)
+  return;
+
+ enqueue_ready_thread(cpu, current_thread_index);
+ dispatch_thread(cpu, next_thread_index);
+}
+
+/*! Checks if a thread may be handed the calling CPU directly.
+    \returns 1 if the thread is allowed to run on the CPU and it would not
+             bypass a ready realtime thread. Returns 0 otherwise. */
+static int
+may_hand_off_to(register struct CPU_private* const cpu
+                /*!< The calling CPU. */,
+                const register int thread_index
+                /*!< Index, into thread_table, of the thread. */)
+{
+ return (-1 == cpu->handoff_thread_index) &&
+        (0 != (thread_table[thread_index].data.affinity_mask &
+               (1UL<<cpu->CPU_index))) &&
+        (is_realtime_thread(thread_index) ||
+         thread_queue_is_empty(&cpu->realtime_queue));
+}
+
+void
+hand_off_CPU(const int thread_index)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ if (may_hand_off_to(cpu, thread_index))
+  cpu->handoff_thread_index = thread_index;
+ else
+  make_thread_ready(thread_index);
+}
+
+int
+directed_yield(const int thread_index)
+{
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+ register const int current_thread_index = cpu->thread_index;
+
+ if (!may_hand_off_to(cpu, thread_index) ||
+     thread_preempts(current_thread_index, thread_index))
+ {
+  make_thread_ready(thread_index);
+  return 0;
+ }
+
+ enqueue_ready_thread(cpu, current_thread_index);
+ cpu->handoff_thread_index = thread_index;
+ return 1;
+}
 
 void
 scheduler_called_from_system_call_handler(const register int schedule)
 {
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+
+ /* The system call has blocked, or otherwise given up, the running thread.
+    Find a new one. The blocked thread keeps its feedback level. */
+ if (schedule)
+ {
+  register const int thread_index = cpu->handoff_thread_index;
+
+  /* The system call may have picked the next thread itself. */
+  if (-1 != thread_index)
+  {
+   cpu->handoff_thread_index = -1;
+   dispatch_thread(cpu, thread_index);
+   return;
+  }
+
+  dispatch_next_thread(cpu);
+ }
 }
 
 void
 scheduler_called_from_timer_interrupt_handler(const register int thread_changed)
 {
+ register struct CPU_private* const cpu =
+  &CPU_private_table[get_processor_index()];
+ register int current_thread_index = cpu->thread_index;
+ register int next_thread_index;
+
+ cpu->statistics.run_queue_length_histogram[
+  histogram_bucket(cpu->ready_queue_length)]++;
+
+ if (--cpu->ticks_until_priority_boost <= 0)
+ {
+  cpu->ticks_until_priority_boost = PRIORITY_BOOST_INTERVAL_TICKS;
+  boost_ready_threads(cpu);
+  if (-1 != current_thread_index)
+   thread_table[current_thread_index].data.feedback_level = 0;
+ }
+
+ if (thread_changed)
+ {
+  /* The interrupt handler has let a woken thread run on the idle CPU. Give
+     it a full quantum. */
+  dispatch_thread(cpu, current_thread_index);
+  return;
+ }
+
+ if (-1 == current_thread_index)
+ {
+  /* The CPU is idle. Look for work locally and on the other CPUs. This is
+     a fallback as CPUs are normally woken by IPIs when work arrives. */
+  dispatch_next_thread(cpu);
+  return;
+ }
+
+ charge_process(current_thread_index);
+
+ if (is_realtime_thread(current_thread_index))
+ {
+  /* Realtime threads run until they block, use up their budget or a
+     thread with an earlier deadline becomes ready. */
+  if (--thread_table[current_thread_index].data.budget_left <= 0)
+  {
+   start_next_period(current_thread_index);
+   dispatch_next_thread(cpu);
+   return;
+  }
+
+  next_thread_index = dequeue_preempting_thread(cpu, current_thread_index);
+  if (-1 == next_thread_index)
+   return;
+ }
+ else if (--cpu->ticks_left_of_time_slice > 0)
+ {
+  /* The quantum is not used up. Only preempt the running thread if a
+     realtime thread or a thread with a higher priority has become ready.
+     The running thread keeps its level. */
+  next_thread_index = dequeue_preempting_thread(cpu, current_thread_index);
+  if (-1 == next_thread_index)
+   return;
+ }
+ else
+ {
+  /* The quantum is used up. Demote the running thread and let the best
+     thread on this CPU, not having a lower priority than the running thread,
+     run. There is no point in stealing work just to preempt the running
+     thread. */
+  if (thread_table[current_thread_index].data.feedback_level <
+      (NUMBER_OF_FEEDBACK_LEVELS-1))
+   thread_table[current_thread_index].data.feedback_level++;
+
+  next_thread_index = dequeue_realtime_thread(cpu);
+  if (-1 == next_thread_index)
+   next_thread_index = dequeue_ready_thread(cpu,
+                        effective_priority(current_thread_index));
+  if (-1 == next_thread_index)
+  {
+   dispatch_thread(cpu, current_thread_index);
+   return;
+  }
+ }
+
+ enqueue_ready_thread(cpu, current_thread_index);
+ dispatch_thread(cpu, next_thread_index);
 }
@@ -0,0 +1,139 @@
+/*! \file slab.c
+    \brief Holds the implementation of the object caches.
+
+    An object cache hands out objects of one size from slabs, page frames
+    cut into as many objects as fit. Each slab ends with an array of ints
+    that links its free objects into the free list of the cache. Objects are
+    constructed once, when their slab is allocated, and are freed in the
+    constructed state so allocating an object does not have to set it up
+    again.
+
+    Allocation and freeing are O(1). Each CPU keeps a magazine of free
+    objects in the cache. The kernel runs with interrupts disabled so a CPU
+    uses its own magazine without locks. Only when the magazine is empty, or
+    full, is the lock of the cache grabbed to move OBJECT_MAGAZINE_SIZE/2
+    objects between the magazine and the free list. */
+
+#include "kernel.h"
+#include "mm.h"
+#include "slab.h"
+
+/* The function interfaces are documented in slab.h */
+
+/*! Gets the free list link of an object. */
+inline static int*
+free_link(const struct object_cache* const cache, const int handle)
+{
+ return ((int*) (cache->slabs[handle/cache->objects_per_slab] +
+                 cache->objects_per_slab*cache->object_size)) +
+        handle % cache->objects_per_slab;
+}
+
+/*! Allocates and constructs a new slab and puts its objects on the free
+    list. The caller must hold the lock of the cache.
+    \return 1 if the cache grew and 0 otherwise. */
+static int
+grow_object_cache(struct object_cache* const cache)
+{
+ register const unsigned int slab = cache->number_of_slabs;
+ register const int          first = slab*cache->objects_per_slab;
+ register long               address;
+ register int                i;
+
+ if (slab >= cache->max_number_of_slabs)
+  return 0;
+
+ address = kalloc(SLAB_SIZE, KERNEL_FRAME_OWNER, ALLOCATE_FLAG_KERNEL);
+ if (ERROR == address)
+  return 0;
+
+ cache->slabs[slab] = (char*) address;
+
+ for(i=cache->objects_per_slab-1; i>=0; i--)
+ {
+  cache->constructor(cache->slabs[slab]+i*cache->object_size, first+i);
+  *free_link(cache, first+i) = cache->free_list;
+  cache->free_list = first+i;
+ }
+
+ /* Lock-free readers may see the objects once number_of_slabs includes
+    the slab. */
+ __asm volatile("" : : : "memory");
+ cache->number_of_slabs = slab+1;
+ return 1;
+}
+
+void
+initialize_object_cache(struct object_cache* const cache,
+                        const unsigned int object_size,
+                        void (* const constructor)(void*, const int),
+                        char** const slabs,
+                        const unsigned int max_number_of_slabs)
+{
+ register int i;
+
+ initialize_spin_lock(&cache->lock, LOCK_CLASS_OBJECT_CACHE);
+ cache->object_size = object_size;
+ cache->objects_per_slab = OBJECTS_PER_SLAB(object_size);
+ cache->max_number_of_slabs = max_number_of_slabs;
+ cache->number_of_slabs = 0;
+ cache->slabs = slabs;
+ cache->free_list = -1;
+ cache->constructor = constructor;
+
+ for(i=0; i<MAX_NUMBER_OF_CPUS; i++)
+  cache->magazines[i].count = 0;
+}
+
+int
+object_cache_allocate(struct object_cache* const cache)
+{
+ register struct object_magazine* const magazine =
+  &cache->magazines[get_processor_index()];
+
+ if (0 == magazine->count)
+ {
+  grab_lock_rw(&cache->lock);
+  while (magazine->count < OBJECT_MAGAZINE_SIZE/2)
+  {
+   register int handle = cache->free_list;
+
+   if ((-1 == handle) && grow_object_cache(cache))
+    handle = cache->free_list;
+
+   if (-1 == handle)
+    break;
+
+   cache->free_list = *free_link(cache, handle);
+   magazine->objects[magazine->count++] = handle;
+  }
+  release_lock(&cache->lock);
+
+  if (0 == magazine->count)
+   return -1;
+ }
+
+ return magazine->objects[--magazine->count];
+}
+
+void
+object_cache_free(struct object_cache* const cache, const int handle)
+{
+ register struct object_magazine* const magazine =
+  &cache->magazines[get_processor_index()];
+
+ if (OBJECT_MAGAZINE_SIZE == magazine->count)
+ {
+  grab_lock_rw(&cache->lock);
+  while (magazine->count > OBJECT_MAGAZINE_SIZE/2)
+  {
+   register const int freed = magazine->objects[--magazine->count];
+
+   *free_link(cache, freed) = cache->free_list;
+   cache->free_list = freed;
+  }
+  release_lock(&cache->lock);
+ }
+
+ magazine->objects[magazine->count++] = handle;
+}
@@ -0,0 +1,127 @@
+/*! \file slab.h
+    \brief Holds declarations for the object caches. */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "kernel.h"
+
+#define SLAB_SIZE               (4*1024)
+/*!< The size of the memory block, one page frame, a slab is made of. */
+
+#define OBJECTS_PER_SLAB(size)  (SLAB_SIZE/((size)+sizeof(int)))
+/*!< The number of objects of a size that fit in a slab. Each object needs
+     an int for its free list link as well. */
+
+#define NUMBER_OF_SLABS(number_of_objects, size) \
+ (((number_of_objects)+OBJECTS_PER_SLAB(size)-1)/OBJECTS_PER_SLAB(size))
+/*!< The number of slabs needed to hold a number of objects of a size. */
+
+#define OBJECT_MAGAZINE_SIZE    (8)
+/*!< The number of free objects each CPU can keep for itself in a cache. */
+
+/*! Holds the free objects of a cache that only one CPU hands out. Each
+    magazine has its own cache line. */
+struct object_magazine
+{
+ int count;                          /*!< The number of objects in
+                                          objects. */
+ int objects[OBJECT_MAGAZINE_SIZE];  /*!< Handles of free objects. */
+} __attribute__ ((aligned (64)));
+
+/*! Describes a cache of objects of one size. Objects are known by handles,
+    small integers, that stay the same for the lifetime of the system. The
+    cache grows one slab at a time, as objects are needed, up to a maximum
+    number of slabs. Slabs are never given back. */
+struct object_cache
+{
+ struct spin_lock   lock;             /*!< Spin lock used to ensure mutual
+                                           exclusion to free_list and to
+                                           growing the cache. */
+ unsigned int       object_size;      /*!< The size, in bytes, of an
+                                           object. */
+ unsigned int       objects_per_slab; /*!< The number of objects in each
+                                           slab. */
+ unsigned int       max_number_of_slabs;
+                                      /*!< The number of entries in
+                                           slabs. */
+ volatile unsigned int
+                    number_of_slabs;  /*!< The number of slabs allocated so
+                                           far. Read without the lock. */
+ char**             slabs;            /*!< The addresses of the slabs. */
+ int                free_list;        /*!< The handle of the first free
+                                           object not in a magazine or
+                                           -1. */
+ void             (*constructor)(void*, const int);
+                                      /*!< Called once for every object,
+                                           with its address and handle,
+                                           when its slab is allocated. Freed
+                                           objects must be returned in the
+                                           constructed state. */
+ struct object_magazine
+                    magazines[MAX_NUMBER_OF_CPUS];
+                                      /*!< The free objects each CPU keeps
+                                           for itself. */
+};
+
+/*! Initializes an object cache. No memory is allocated until the first
+    object is. */
+extern void
+initialize_object_cache(struct object_cache* const cache
+                         /*!< The cache to initialize. */,
+                        const unsigned int object_size
+                         /*!< The size, in bytes, of each object. */,
+                        void (* const constructor)(void*, const int)
+                         /*!< Sets up an object in a new slab. */,
+                        char** const slabs
+                         /*!< Array, with max_number_of_slabs entries,
+                              holding the addresses of the slabs. */,
+                        const unsigned int max_number_of_slabs
+                         /*!< The largest number of slabs the cache may
+                              grow to. */);
+
+/*! Allocates a constructed object from a cache. Takes the object from the
+    magazine of the calling CPU if it can. A new slab is allocated if the
+    cache has no free objects.
+    \return the handle of the object or -1 if the cache cannot grow. */
+extern int
+object_cache_allocate(struct object_cache* const cache
+                       /*!< The cache to allocate from. */);
+
+/*! Returns an object to its cache. The object must be in the constructed
+    state. */
+extern void
+object_cache_free(struct object_cache* const cache
+                   /*!< The cache the object was allocated from. */,
+                  const int handle
+                   /*!< The handle of the object. */);
+
+/*! Gets the number of object handles in use by a cache, allocated or not.
+    Every handle below this number refers to a constructed object. */
+inline static unsigned int
+object_cache_number_of_objects(const struct object_cache* const cache)
+{
+ return cache->number_of_slabs*cache->objects_per_slab;
+}
+
+/*! Gets the address of an object. Can be called without any locks.
+    \return the address of the object or 0 if the handle does not refer to
+    an object in the cache. */
+inline static void*
+object_cache_get(const struct object_cache* const cache
+                  /*!< The cache of the object. */,
+                 const unsigned long handle
+                  /*!< The handle of the object. */)
+{
+ register const unsigned long slab = handle/cache->objects_per_slab;
+
+ if (slab >= cache->number_of_slabs)
+  return 0;
+
+ /* The slab address is written before number_of_slabs is increased. */
+ __asm volatile("" : : : "memory");
+ return cache->slabs[slab] +
+        (handle % cache->objects_per_slab)*cache->object_size;
+}
+
+#endif
@@ -3,86 +3,155 @@
 
 #include "kernel.h"
 #include "sync.h"
+#include "timer.h"
 
 /* The function interfaces are documented in sync.h */
 
-struct port
-port_table[MAX_NUMBER_OF_PORTS];
+struct object_cache
+port_cache;
+
+/*! The addresses of the slabs of port_cache. */
+static char*
+port_slabs[NUMBER_OF_SLABS(MAX_NUMBER_OF_PORTS, sizeof(struct port))];
+
+struct spin_lock
+port_table_lock=SPIN_LOCK_INITIALIZER(LOCK_CLASS_PORT_TABLE);
+
+/*! Sets up a port in a new slab of port_cache. Freed ports are returned to
+    the cache in the same state: free, without a receiver and with an empty
+    sender queue. */
+static void
+construct_port(void* const object, const int handle)
+{
+ register struct port* const port_ptr=(struct port*) object;
+
+ port_ptr->owner=PORT_OWNER_FREE;
+ port_ptr->handle=handle;
+ port_ptr->receiver=-1;
+ thread_queue_init(&port_ptr->sender_queue);
+ initialize_spin_lock(&port_ptr->lock, LOCK_CLASS_PORT);
+}
 
 void
 initialize_ports(void)
 {
- register int i;
-
- /* Loop over all ports in the table and set the owner to -1 indicating a 
-    free port. */
- for(i=0; i<MAX_NUMBER_OF_PORTS; i++)
- {
-  port_table[i].owner=-1;
- }
+ initialize_object_cache(&port_cache, sizeof(struct port), construct_port,
+                         port_slabs,
+                         NUMBER_OF_SLABS(MAX_NUMBER_OF_PORTS,
+                                         sizeof(struct port)));
 }
 
 int
 allocate_port(const unsigned long id, const int new_owner)
 {
- register int i;
- register int first_available=-1;
+ register int          port;
+ register struct port* port_ptr;
 
- /* Loop over all ports to see if the port has already been allocated. */
- for(i=0; i<MAX_NUMBER_OF_PORTS; i++)
- {
-  /* We keep track of the first available port. This way we do not
-     have to scan the table twice. */
-  if ((-1 == port_table[i].owner) &&
-      (-1 == first_available))
-  {
-   first_available=i;
-  }
+ grab_lock_rw(&port_table_lock);
 
-  /* Check if the port entry match the one we want to create. */
-  if ((new_owner == port_table[i].owner) &&
-      (id == port_table[i].id))
-  {
-   return -1;
-  }
+ /* Each process can only have one port with an identity. */
+ if (-1 != find_port(id, new_owner))
+ {
+  release_lock(&port_table_lock);
+  return -1;
  }
 
- if (-1 != first_available)
+ port=object_cache_allocate(&port_cache);
+ if (-1 == port)
  {
-  /* Set the new owner and new identity. */
-  port_table[first_available].owner=new_owner;
-  port_table[first_available].id=id;
-
-  /* Initially, the sender queue is  empty and there are no receiving thread. */
-  port_table[first_available].receiver=-1;
-  thread_queue_init(&port_table[first_available].sender_queue);
-
-  return first_available;
+  /* Return -1 if we ran out of ports. */
+  release_lock(&port_table_lock);
+  return -1;
  }
 
- /* Return -1 if we ran out of ports. */
- return -1;
+ /* The port comes from the cache without a receiver and with an empty
+    sender queue. Set the new identity and new owner. The owner is set last
+    as port_is_valid reads it without the lock. */
+ port_ptr=get_port(port);
+ port_ptr->id=id;
+ __asm volatile("" : : : "memory");
+ port_ptr->owner=new_owner;
+
+ release_lock(&port_table_lock);
+ return port;
 }
 
 int
 find_port(const unsigned long id, const int owner)
 {
- register int i;
+ register unsigned int i;
+ register unsigned int number_of_ports;
 
- /* Loop over all ports in the table. */
- for(i=0; i<MAX_NUMBER_OF_PORTS; i++)
+ rcu_read_lock();
+
+ /* Loop over all ports allocated so far. */
+ number_of_ports=object_cache_number_of_objects(&port_cache);
+ for(i=0; i<number_of_ports; i++)
  {
+  register const struct port* const port_ptr=get_port(i);
+
   /* Return as soon as we find a match. */
-  if ((owner == port_table[i].owner) &&
-      (id == port_table[i].id))
+  if ((owner == port_ptr->owner) &&
+      (id == port_ptr->id))
   {
+   rcu_read_unlock();
    return i;
   }
  }
 
+ rcu_read_unlock();
  return -1;
 }
 
+/*! Makes a port allocatable again. Called when no lookup can still see the
+    port. */
+static void
+reclaim_port(struct rcu_head* const head)
+{
+ register struct port* const port_ptr=
+  (struct port*) (((char*) head) - __builtin_offsetof(struct port, rcu));
+
+ port_ptr->owner=PORT_OWNER_FREE;
+ object_cache_free(&port_cache, port_ptr->handle);
+}
+
+void
+free_ports_of_process(const int process)
+{
+ register unsigned int i;
+ register unsigned int number_of_ports;
+
+ grab_lock_rw(&port_table_lock);
+
+ number_of_ports=object_cache_number_of_objects(&port_cache);
+ for(i=0; i<number_of_ports; i++)
+ {
+  register struct port* const port_ptr=get_port(i);
+  register int sender;
+
+  if (process != port_ptr->owner)
+   continue;
+
+  /* New lookups fail from now on. Lookups in progress may still use the
+     port until the grace period ends. */
+  port_ptr->owner=PORT_OWNER_DYING;
+
+  grab_lock_rw(&port_ptr->lock);
+  port_ptr->receiver=-1;
+  while(-1 != (sender=thread_queue_dequeue(&port_ptr->sender_queue)))
+  {
+   thread_table[sender].data.waiting_for_reply=0;
+   thread_table[sender].data.registers.integer_registers.rax=ERROR;
+   make_thread_ready(sender);
+  }
+  release_lock(&port_ptr->lock);
+
+  call_rcu(&port_ptr->rcu, reclaim_port);
+ }
+
+ release_lock(&port_table_lock);
+}
+
 void
 initialize_thread_synchronization(void)
 {
@@ -90,3 +159,282 @@ initialize_thread_synchronization(void)
 }
 
 /* Put any code you need to add to implement tasks B5, A5, B6 or A6 here. */
+
+/*! Checks if a port handle refers to an allocated port.
+    \return 1 if the port is allocated and 0 otherwise. */
+static int
+port_is_valid(const unsigned long port)
+{
+ register const struct port* const port_ptr=get_port(port);
+
+ return (0 != port_ptr) && (0 <= port_ptr->owner);
+}
+
+/*! Copies the message of a sending thread to the buffer of a receiving
+    thread and sets the return values of the receiving thread. */
+static void
+deliver_message(const int sender, const int receiver)
+{
+ *((struct message*)
+   thread_table[receiver].data.registers.integer_registers.rbx)=
+  *((struct message*)
+    thread_table[sender].data.registers.integer_registers.rbx);
+
+ thread_table[receiver].data.registers.integer_registers.rax=ALL_OK;
+ thread_table[receiver].data.registers.integer_registers.rdi=
+  thread_table[sender].data.owner;
+ thread_table[receiver].data.registers.integer_registers.rsi=
+  SYSCALL_MSG_SHORT;
+}
+
+/*! Fails the call of a thread waiting for a reply that will never come. */
+static void
+abandon_reply(const int thread_index)
+{
+ register const int caller=thread_table[thread_index].data.reply_thread;
+
+ if (-1 == caller)
+  return;
+
+ thread_table[thread_index].data.reply_thread=-1;
+ thread_table[caller].data.waiting_for_reply=0;
+ thread_table[caller].data.registers.integer_registers.rax=ERROR;
+ make_thread_ready(caller);
+}
+
+/*! Takes a message waiting on a port or registers the thread as receiver.
+    A timeout_ticks of -1 blocks the thread without a timeout.
+    \return 0 if a message was received, 1 if the thread has to block, -1
+    if the port cannot be received on and -2 if there is no message and
+    timeout_ticks is 0. */
+static int
+receive_message(const int thread_index,
+                const unsigned long port,
+                const long timeout_ticks)
+{
+ register struct port* const port_ptr=get_port(port);
+ register int sender;
+
+ if (!port_is_valid(port) ||
+     (thread_table[thread_index].data.owner != port_ptr->owner))
+  return -1;
+
+ grab_lock_rw(&port_ptr->lock);
+
+ /* The port may have been freed since it was checked. Only one thread at a
+    time can receive on a port. */
+ if ((thread_table[thread_index].data.owner != port_ptr->owner) ||
+     (-1 != port_ptr->receiver))
+ {
+  release_lock(&port_ptr->lock);
+  return -1;
+ }
+
+ sender=thread_queue_dequeue(&port_ptr->sender_queue);
+ if (-1 == sender)
+ {
+  if (0 == timeout_ticks)
+  {
+   release_lock(&port_ptr->lock);
+   return -2;
+  }
+
+  /* The timeout is armed before the port lock is released so that a sender
+     always sees a thread which is also in the timer wheel. */
+  if (0 < timeout_ticks)
+   timer_wheel_arm_timeout(thread_index, timeout_ticks, port);
+
+  port_ptr->receiver=thread_index;
+  release_lock(&port_ptr->lock);
+  return 1;
+ }
+
+ release_lock(&port_ptr->lock);
+
+ deliver_message(sender, thread_index);
+
+ /* A caller stays blocked until it gets its reply. */
+ if (thread_table[sender].data.waiting_for_reply)
+ {
+  thread_table[thread_index].data.reply_thread=sender;
+ }
+ else
+ {
+  thread_table[sender].data.registers.integer_registers.rax=ALL_OK;
+  make_thread_ready(sender);
+ }
+
+ return 0;
+}
+
+/*! Takes the receiver of a port or puts the thread in the sender queue.
+    \return The index of the receiving thread, -1 if the thread has been put
+    in the sender queue or -2 if the port has been freed. */
+static int
+find_receiver(const int thread_index, const unsigned long port)
+{
+ register struct port* const port_ptr=get_port(port);
+ register int receiver;
+
+ grab_lock_rw(&port_ptr->lock);
+
+ /* free_ports_of_process drains the sender queue under the lock. A thread
+    put in the queue after that would never be woken up. */
+ if (0 > port_ptr->owner)
+ {
+  release_lock(&port_ptr->lock);
+  return -2;
+ }
+
+ receiver=port_ptr->receiver;
+ if (-1 != receiver)
+ {
+  port_ptr->receiver=-1;
+
+  /* A receiver whose timeout has won is left to timeout_expired. */
+  if (!timer_wheel_claim_waiter(receiver))
+   receiver=-1;
+ }
+
+ if (-1 == receiver)
+  thread_queue_enqueue(&port_ptr->sender_queue, thread_index);
+
+ release_lock(&port_ptr->lock);
+
+ return receiver;
+}
+
+int
+ipc_send(const int           thread_index,
+         const unsigned long port,
+         const unsigned long message_type)
+{
+ register int receiver;
+
+ if (!port_is_valid(port) || (SYSCALL_MSG_SHORT != message_type))
+ {
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+  return 0;
+ }
+
+ receiver=find_receiver(thread_index, port);
+ if (-1 == receiver)
+  return 1;
+
+ if (-2 == receiver)
+ {
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+  return 0;
+ }
+
+ deliver_message(thread_index, receiver);
+ thread_table[thread_index].data.registers.integer_registers.rax=ALL_OK;
+
+ /* The sender stays ready. Let the receiver run first if its priority
+    allows it. */
+ return directed_yield(receiver);
+}
+
+int
+ipc_receive(const int           thread_index,
+            const unsigned long port,
+            const long          timeout_ticks)
+{
+ register int result;
+
+ abandon_reply(thread_index);
+
+ result=receive_message(thread_index, port, timeout_ticks);
+ if (-1 == result)
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+ else if (-2 == result)
+  thread_table[thread_index].data.registers.integer_registers.rax=
+   ERROR_TIMEOUT;
+
+ return 1 == result;
+}
+
+void
+ipc_cancel_receive(const int thread_index, const int port)
+{
+ register struct port* const port_ptr=get_port(port);
+
+ grab_lock_rw(&port_ptr->lock);
+ if (thread_index == port_ptr->receiver)
+  port_ptr->receiver=-1;
+ release_lock(&port_ptr->lock);
+}
+
+int
+ipc_call(const int           thread_index,
+         const unsigned long port)
+{
+ register int receiver;
+
+ if (!port_is_valid(port))
+ {
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+  return 0;
+ }
+
+ /* Mark the thread as a caller before a receiver can see it. */
+ thread_table[thread_index].data.waiting_for_reply=1;
+
+ receiver=find_receiver(thread_index, port);
+ if (-1 == receiver)
+  return 1;
+
+ if (-2 == receiver)
+ {
+  thread_table[thread_index].data.waiting_for_reply=0;
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+  return 0;
+ }
+
+ deliver_message(thread_index, receiver);
+ thread_table[receiver].data.reply_thread=thread_index;
+
+ /* The caller blocks until the reply so the receiver can have the CPU. */
+ hand_off_CPU(receiver);
+ return 1;
+}
+
+int
+ipc_reply_wait(const int           thread_index,
+               const unsigned long port)
+{
+ register const int caller=thread_table[thread_index].data.reply_thread;
+ register int       result;
+
+ if (!port_is_valid(port) ||
+     (thread_table[thread_index].data.owner != get_port(port)->owner))
+ {
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+  return 0;
+ }
+
+ if (-1 != caller)
+ {
+  thread_table[thread_index].data.reply_thread=-1;
+  deliver_message(thread_index, caller);
+  thread_table[caller].data.waiting_for_reply=0;
+ }
+
+ result=receive_message(thread_index, port, -1);
+
+ if (1 == result)
+ {
+  /* The thread blocks. Let the caller have the CPU. */
+  if (-1 != caller)
+   hand_off_CPU(caller);
+  return 1;
+ }
+
+ if (-1 == result)
+  thread_table[thread_index].data.registers.integer_registers.rax=ERROR;
+
+ if (-1 != caller)
+  make_thread_ready(caller);
+
+ return 0;
+}
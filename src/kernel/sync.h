@@ -5,8 +5,11 @@
 #define _SYNC_H_
 
 #include "threadqueue.h"
+#include "rcu.h"
+#include "slab.h"
 
-#define MAX_NUMBER_OF_PORTS     (256)
+#define MAX_NUMBER_OF_PORTS     (4096)
+/*!< The largest number of ports the port cache may grow to. */
 
 /*! Describes a port. */
 struct port
@@ -19,18 +22,46 @@ struct port
  struct thread_queue sender_queue; /*!< The queue of threads which are blocked on a send operation */
  
  int receiver; /*!< The identity of a thread which is blocked on a receive opereation. Set to -1 if no thread is receiving. */
+
+ struct spin_lock lock; /*!< Spin lock used to ensure mutual exclusion to sender_queue and receiver. */
+
+ struct rcu_head rcu; /*!< Used to free the port once no lock-free lookup can still see it. */
+
+ int handle; /*!< The handle of the port in port_cache. */
 };
 
-extern struct port
-port_table[MAX_NUMBER_OF_PORTS];
-/*!< Array holding information all ports. */
+#define PORT_OWNER_FREE  (-1)
+/*!< The owner of a port that can be allocated. */
+#define PORT_OWNER_DYING (-2)
+/*!< The owner of a freed port that lookups may still see. It becomes free
+     after an RCU grace period. */
+
+extern struct object_cache
+port_cache;
+/*!< The cache all ports are allocated from. A port handle is the handle of
+     its object in the cache. */
+
+extern struct spin_lock
+port_table_lock;
+/*!< Spin lock used to ensure mutual exclusion between threads allocating
+     and freeing ports. Ports are looked up without locks. A freed port is
+     not reused until an RCU grace period has passed. */
 
-/*! Initializes the port table. */
+/*! Gets the port a handle refers to. Can be called without any locks.
+    \return a pointer to the port or 0 if the handle is out of range. */
+inline static struct port*
+get_port(const unsigned long port
+          /*!< Handle of the port. */)
+{
+ return (struct port*) object_cache_get(&port_cache, port);
+}
+
+/*! Initializes the port cache. */
 extern void
 initialize_ports(void);
 
-/*! Allocates and initializes one port from the port table.
-    \return an index into the port_table if a port could be allocated or -1 
+/*! Allocates and initializes one port from the port cache.
+    \return the handle of the port if a port could be allocated or -1 
     if no ports are available. */
 extern int
 allocate_port(const unsigned long id
@@ -38,15 +69,22 @@ allocate_port(const unsigned long id
               const int new_owner
                /*!< Id of the process becoming the new owner of the port after allocation. */);
 
-/*! Find a port with identity if owned by process owner. 
-    \return the index into port_table of the port if a matching port is 
-    found. Returns -1 otherwise. */
+/*! Find a port with identity if owned by process owner. The ports are
+    searched without taking any locks.
+    \return the handle of the port if a matching port is found. Returns -1
+    otherwise. */
 extern int
 find_port(const unsigned long id
            /*! Identity number of the port that we want to find. */, 
           const int owner
            /*! Id of the owning process of the port that we want to find. */);
 
+/*! Frees all ports owned by a process. Threads blocked sending to the ports
+    get ERROR. The ports can be allocated again after an RCU grace period. */
+extern void
+free_ports_of_process(const int process
+                       /*!< Index, into process_table, of the process. */);
+
 /*! Initializes the thread synchronization sub-system. Used in task 6. */
 extern void
 initialize_thread_synchronization(void);
@@ -54,5 +92,67 @@ initialize_thread_synchronization(void);
 /* Put any declarations you need to add to implement tasks B5, A5, B6 or A6 
    here. */
 
+/*! Sends a short message from a thread to a port. The message is pointed to
+    by the saved rbx register of the thread. If a thread is blocked receiving
+    on the port the message is copied to it at once and it is handed the CPU
+    unless it has a lower priority than the sender. Otherwise the sender
+    blocks in the sender queue of the port until the message is received.
+    \return 1 if the calling thread has to be rescheduled and 0 otherwise. */
+extern int
+ipc_send(const int           thread_index
+          /*!< Index, into thread_table, of the sending thread. */,
+         const unsigned long port
+          /*!< Handle of the destination port. */,
+         const unsigned long message_type
+          /*!< The message type. Only SYSCALL_MSG_SHORT is supported. */);
+
+/*! Receives a short message on a port. The message is copied to the buffer
+    pointed to by the saved rbx register of the thread. The thread blocks if
+    no message is waiting. A thread waiting for a reply from the receiving
+    thread, which has not been given one, gets an error.
+    \return 1 if the calling thread has to be rescheduled and 0 otherwise. */
+extern int
+ipc_receive(const int           thread_index
+             /*!< Index, into thread_table, of the receiving thread. */,
+            const unsigned long port
+             /*!< Handle of the port. It must be owned by the process of the
+                  receiving thread. */,
+            const long          timeout_ticks
+             /*!< The number of clock ticks to wait for a message, 0 to not
+                  wait at all or -1 to wait forever. The thread gets
+                  ERROR_TIMEOUT if no message arrived in time. */);
+
+/*! Stops a thread whose receive has timed out from being the receiver of a
+    port. Does nothing if a sender has already taken the thread. */
+extern void
+ipc_cancel_receive(const int thread_index
+                    /*!< Index, into thread_table, of the receiving
+                         thread. */,
+                   const int port
+                    /*!< Handle of the port the thread receives on. */);
+
+/*! Sends a short message to a port and blocks until the receiver replies
+    through ipc_reply_wait. If a thread is blocked receiving on the port it
+    is handed the CPU directly. The reply is copied to the message buffer.
+    \return 1 if the calling thread has to be rescheduled and 0 otherwise. */
+extern int
+ipc_call(const int           thread_index
+          /*!< Index, into thread_table, of the calling thread. */,
+         const unsigned long port
+          /*!< Handle of the destination port. */);
+
+/*! Replies to the thread waiting in ipc_call for the calling thread, if
+    there is one, and then receives the next message on a port. The reply is
+    taken from, and the next message copied to, the buffer pointed to by the
+    saved rbx register. If the thread blocks it hands its CPU directly to the
+    thread it replied to.
+    \return 1 if the calling thread has to be rescheduled and 0 otherwise. */
+extern int
+ipc_reply_wait(const int           thread_index
+                /*!< Index, into thread_table, of the replying thread. */,
+               const unsigned long port
+                /*!< Handle of the port to receive on. It must be owned by the
+                     process of the thread. */);
+
 
 #endif
\ No newline at end of file
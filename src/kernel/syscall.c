@@ -5,6 +5,8 @@
  */
 
 #include "kernel.h"
+#include "sync.h"
+#include "timer.h"
 
 int
 system_call_implementation(void)
@@ -42,6 +44,299 @@ system_call_implementation(void)
 
   /* Add the implementation of more system calls here. */
 
+  case SYSCALL_SEND:
+  {
+   schedule=ipc_send(get_current_thread(),
+                     SYSCALL_ARGUMENTS.rdi,
+                     SYSCALL_ARGUMENTS.rsi);
+   break;
+  }
+
+  case SYSCALL_RECEIVE:
+  {
+   schedule=ipc_receive(get_current_thread(), SYSCALL_ARGUMENTS.rdi, -1);
+   break;
+  }
+
+  case SYSCALL_RECEIVETIMEOUT:
+  {
+   register const unsigned long timeout_ticks=SYSCALL_ARGUMENTS.rdx;
+
+   /* Timeouts which do not fit in a long are as good as forever. */
+   schedule=ipc_receive(get_current_thread(), SYSCALL_ARGUMENTS.rdi,
+                        ((long) timeout_ticks) < 0 ? -1 : timeout_ticks);
+   break;
+  }
+
+  case SYSCALL_CALL:
+  {
+   schedule=ipc_call(get_current_thread(), SYSCALL_ARGUMENTS.rdi);
+   break;
+  }
+
+  case SYSCALL_REPLYWAIT:
+  {
+   schedule=ipc_reply_wait(get_current_thread(), SYSCALL_ARGUMENTS.rdi);
+   break;
+  }
+
+  case SYSCALL_SETPRIORITY:
+  {
+   unsigned long priority=SYSCALL_ARGUMENTS.rdi;
+
+   /* Return an error if the priority is out of range. */
+   if (priority >= NUMBER_OF_PRIORITY_LEVELS)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* The new priority is used the next time the thread is inserted into a
+      ready queue or is compared with a ready thread at a clock tick. */
+   thread_table[get_current_thread()].data.priority=priority;
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+   break;
+  }
+
+  case SYSCALL_SETAFFINITY:
+  {
+   register int           current_thread_index=get_current_thread();
+   register unsigned long affinity_mask=SYSCALL_ARGUMENTS.rdi &
+                                        ((1UL<<number_of_available_CPUs)-1);
+
+   /* Return an error if the thread would not be allowed to run anywhere.
+      Realtime threads are bound to the CPU they are admitted on. */
+   if ((0 == affinity_mask) ||
+       (0 != thread_table[current_thread_index].data.realtime_period))
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   thread_table[current_thread_index].data.affinity_mask=affinity_mask;
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+
+   /* Move the thread if it is no longer allowed to run on this CPU. The
+      return value has to be set before the thread is made ready as another
+      CPU may start running it at once. */
+   if (0 == (affinity_mask & (1UL<<get_processor_index())))
+   {
+    make_thread_ready(current_thread_index);
+    schedule=1;
+   }
+   break;
+  }
+
+  case SYSCALL_GETMIGRATIONS:
+  {
+   SYSCALL_ARGUMENTS.rax = thread_table[get_current_thread()].data.migrations;
+   break;
+  }
+
+  case SYSCALL_SETWEIGHT:
+  {
+   register struct process* process=
+    &process_table[thread_table[get_current_thread()].data.owner];
+   unsigned long weight=SYSCALL_ARGUMENTS.rdi;
+
+   /* Return an error if the weight is out of range. */
+   if ((0 == weight) || (weight > MAX_PROCESS_WEIGHT))
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* The pass already accumulated is kept. The new stride is used from the
+      next clock tick. */
+   grab_lock_rw(&process_table_lock);
+   process->weight=weight;
+   process->stride=STRIDE_ONE/weight;
+   release_lock(&process_table_lock);
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+   break;
+  }
+
+  case SYSCALL_GETPROCESSTICKS:
+  {
+   unsigned long process=SYSCALL_ARGUMENTS.rdi;
+
+   /* Return an error if the process argument is wrong. */
+   if (process >= MAX_NUMBER_OF_PROCESSES)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   rcu_read_lock();
+   SYSCALL_ARGUMENTS.rax = process_table[process].consumed_ticks;
+   rcu_read_unlock();
+   break;
+  }
+
+  case SYSCALL_SETREALTIME:
+  {
+   register int current_thread_index=get_current_thread();
+   register int CPU_index=set_realtime_parameters(current_thread_index,
+                                                  SYSCALL_ARGUMENTS.rdi,
+                                                  SYSCALL_ARGUMENTS.rsi,
+                                                  SYSCALL_ARGUMENTS.rdx);
+
+   if (-1 == CPU_index)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+
+   /* Move the thread if it was admitted on another CPU. */
+   if (get_processor_index() != CPU_index)
+   {
+    make_thread_ready(current_thread_index);
+    schedule=1;
+   }
+   break;
+  }
+
+  case SYSCALL_WAITNEXTPERIOD:
+  {
+   register int current_thread_index=get_current_thread();
+
+   if (0 == thread_table[current_thread_index].data.realtime_period)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* Set the return value before the thread may be made ready. */
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+   start_next_period(current_thread_index);
+   schedule=1;
+   break;
+  }
+
+  case SYSCALL_PAUSEUNTIL:
+  {
+   register const long wakeup_time=SYSCALL_ARGUMENTS.rdi;
+   register const long slack=SYSCALL_ARGUMENTS.rsi;
+
+   if (slack < 0)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* Set the return value before the thread may be made ready. */
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+
+   if (wakeup_time <= system_time)
+    break;
+
+   timer_wheel_insert_absolute(get_current_thread(), wakeup_time, slack);
+   schedule=1;
+   break;
+  }
+
+  case SYSCALL_SETPERIODICTIMER:
+  {
+   register union thread* const thread=&thread_table[get_current_thread()];
+   register const long period=SYSCALL_ARGUMENTS.rdi;
+   register const long slack=SYSCALL_ARGUMENTS.rsi;
+
+   if ((period < 0) || (slack < 0) || ((0 != period) && (slack >= period)))
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   thread->data.periodic_timer_period=period;
+   thread->data.periodic_timer_expiry=system_time+period;
+   thread->data.periodic_timer_slack=slack;
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+   break;
+  }
+
+  case SYSCALL_WAITPERIODICTIMER:
+  {
+   register const int           current_thread_index=get_current_thread();
+   register union thread* const thread=&thread_table[current_thread_index];
+   register const long          period=thread->data.periodic_timer_period;
+   register const long          expiry=thread->data.periodic_timer_expiry;
+
+   if (0 == period)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* The timer re-arms itself one period after each expiry. A thread which
+      comes late gets all expirations it missed without blocking. */
+   if (expiry <= system_time)
+   {
+    register const long expirations=(system_time-expiry)/period+1;
+
+    thread->data.periodic_timer_expiry=expiry+expirations*period;
+    SYSCALL_ARGUMENTS.rax = expirations;
+    break;
+   }
+
+   /* Set the return value before the thread may be made ready. */
+   SYSCALL_ARGUMENTS.rax = 1;
+   thread->data.periodic_timer_expiry=expiry+period;
+   timer_wheel_insert_absolute(current_thread_index, expiry,
+                               thread->data.periodic_timer_slack);
+   schedule=1;
+   break;
+  }
+
+  case SYSCALL_GETSCHEDULERSTATISTICS:
+  {
+   unsigned long CPU_index=SYSCALL_ARGUMENTS.rdi;
+
+   /* Return an error if the CPU argument is wrong. */
+   if (CPU_index >= number_of_available_CPUs)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* The statistics are copied without any locks. The counters of another
+      CPU may change while they are copied. */
+   *((struct scheduler_statistics*) SYSCALL_ARGUMENTS.rsi) =
+    CPU_private_table[CPU_index].statistics;
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+   break;
+  }
+
+
+  case SYSCALL_GETLOCKSTATISTICS:
+  {
+#ifdef LOCKSTAT
+   register const unsigned long lock_class=SYSCALL_ARGUMENTS.rdi;
+
+   if (0 == SYSCALL_ARGUMENTS.rsi)
+   {
+    print_lock_statistics();
+    SYSCALL_ARGUMENTS.rax = ALL_OK;
+    break;
+   }
+
+   if (lock_class >= NUMBER_OF_LOCK_CLASSES)
+   {
+    SYSCALL_ARGUMENTS.rax = ERROR;
+    break;
+   }
+
+   /* The statistics are copied without any locks. They may change while
+      they are copied. */
+   *((struct lock_statistics*) SYSCALL_ARGUMENTS.rsi) =
+    lock_statistics_table[lock_class];
+   SYSCALL_ARGUMENTS.rax = ALL_OK;
+#else
+   SYSCALL_ARGUMENTS.rax = ERROR;
+#endif
+   break;
+  }
 
   /* Do not touch any lines below or including this line. */
   default:
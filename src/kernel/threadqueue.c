@@ -56,6 +56,46 @@ thread_queue_dequeue(struct thread_queue* const queue_ptr)
  return -1;
 }
 
+int
+thread_queue_remove(struct thread_queue* const queue_ptr,
+                    const int thread_index)
+{
+ register int previous_thread_index=-1;
+ register int current_thread_index=queue_ptr->head;
+
+ /* Search for the thread and remember the thread in front of it. */
+ while((-1 != current_thread_index) && (thread_index != current_thread_index))
+ {
+  previous_thread_index=current_thread_index;
+  current_thread_index=thread_table[current_thread_index].data.next;
+ }
+
+ if (-1 == current_thread_index)
+ {
+  /* The thread is not in the queue. */
+  return 0;
+ }
+
+ /* Unlink the thread. */
+ if (-1 == previous_thread_index)
+ {
+  queue_ptr->head=thread_table[thread_index].data.next;
+ }
+ else
+ {
+  thread_table[previous_thread_index].data.next=
+   thread_table[thread_index].data.next;
+ }
+
+ /* Make sure the tail is updated if the thread was the tail. */
+ if (queue_ptr->tail == thread_index)
+ {
+  queue_ptr->tail=previous_thread_index;
+ }
+
+ return 1;
+}
+
 int
 thread_queue_is_empty(const struct thread_queue* const queue_ptr)
 {
@@ -7,15 +7,6 @@
 
 #include "kernel.h"
 
-struct thread_queue
-{
- int head;  /*!< The index to the head of the thread queue.
-                 Is -1 if queue is empty. */
- int tail;  /*!< The index to the tail of the thread queue.
-                 Is -1 if queue is empty. */
-};
-/*!< Describes a queue of threads. */
-
 /*! Initialize a thread queue. */
 extern void
 thread_queue_init(struct thread_queue* const queue_ptr
@@ -36,6 +27,17 @@ extern int
 thread_queue_dequeue(struct thread_queue* const queue_ptr
                     /*!< Points to the thread queue. */);
 
+/*! Remove a thread from anywhere in the queue. The queue is searched from
+    the head so the operation takes time proportional to the position of the
+    thread in the queue. \returns 1 if the thread was found and removed.
+    Returns 0 otherwise. */
+extern int
+thread_queue_remove(struct thread_queue* const queue_ptr
+                    /*!< Points to the thread queue. */,
+                    const int thread_index
+                    /*!< Index, into thread_table, of the thread to be
+                         removed from the thread queue. */);
+
 /*! Checks if the queue is empty. \returns 1 if the queue is empty.
     Returns 0 otherwise. */
 extern int
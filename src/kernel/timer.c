@@ -0,0 +1,418 @@
+/*! \file timer.c
+    \brief Holds the implementation of the timer wheels.
+
+    Threads waiting for the system time to reach a certain value are kept in
+    hierarchical timing wheels, one per CPU. A thread sleeps in the wheel of
+    the CPU it ran on and is woken by that CPU. This way the sleep path only
+    takes the lock of the local wheel and the timer work is spread over all
+    CPUs.
+
+    Level 0 of a wheel has one slot per clock tick for the next
+    TIMER_WHEEL_SLOTS ticks. Every slot on level i+1 covers as many ticks as
+    all of level i. A thread is put in the slot of the lowest level that
+    covers its wake up time. When the low bits of the time of the wheel wrap
+    around the threads in the current slot of the next level are cascaded
+    down to the levels below. This makes insertion and cancellation constant
+    time and each tick only touches the slots that are due.
+
+    A wake up time with slack is rounded to the time in the allowed range
+    with the most trailing zero bits. Threads with overlapping ranges then
+    tend to get the same wake up time and are woken by the same tick. Idle
+    CPUs, which only tick when their wheel needs it, get fewer interrupts.
+
+    The slots are doubly linked lists through the timer_next and
+    timer_previous members of the threads so that a thread can be removed
+    without searching. A bitmap per level tells which slots are non-empty.
+
+    A thread blocked with a timeout is both on a wait object and in a timer
+    wheel. The thread that wakes it up and the CPU whose wheel expires it
+    race to compare and swap its timeout_state from TIMEOUT_ARMED. The loser
+    leaves the thread alone and the winner removes it from the other
+    structure. The wheel does its compare and swap under the wheel lock and
+    the waker removes the thread from the wheel, so the state is back at
+    TIMEOUT_NONE before the thread can run again. */
+
+#include "kernel.h"
+#include "threadqueue.h"
+#include "timer.h"
+
+/* The function interfaces are documented in timer.h */
+
+/*! Describes the timer wheel of a CPU. */
+struct timer_wheel
+{
+ int            slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+                            /*!< The index, into thread_table, of the first
+                                 thread in each slot or -1 if the slot is
+                                 empty. */
+ unsigned long  bitmap[TIMER_WHEEL_LEVELS];
+                            /*!< Bit i is set iff slot i of the level is not
+                                 empty. */
+ long           time;       /*!< The system time the wheel has been advanced
+                                 to. */
+ struct spin_lock
+                lock;       /*!< Spin lock used to ensure mutual exclusion to
+                                 the wheel. */
+} __attribute__ ((aligned (64)));
+
+static struct timer_wheel
+timer_wheels[MAX_NUMBER_OF_CPUS];
+/*!< Array holding the timer wheels of all CPUs. */
+
+void
+initialize_timer_wheels(void)
+{
+ register int i, level, slot;
+
+ for(i=0; i<MAX_NUMBER_OF_CPUS; i++)
+ {
+  for(level=0; level<TIMER_WHEEL_LEVELS; level++)
+  {
+   for(slot=0; slot<TIMER_WHEEL_SLOTS; slot++)
+    timer_wheels[i].slots[level][slot]=-1;
+   timer_wheels[i].bitmap[level]=0;
+  }
+  timer_wheels[i].time=0;
+  initialize_spin_lock(&timer_wheels[i].lock, LOCK_CLASS_TIMER_WHEEL);
+ }
+}
+
+/*! Checks if a timer wheel holds any threads.
+    \returns 1 if the wheel is empty and 0 otherwise. */
+static int
+wheel_is_empty(register const struct timer_wheel* const wheel)
+{
+ register int level;
+
+ for(level=0; level<TIMER_WHEEL_LEVELS; level++)
+ {
+  if (0 != wheel->bitmap[level])
+   return 0;
+ }
+
+ return 1;
+}
+
+/*! Links a thread into the slot covering its wake up time. The caller must
+    hold the lock of the wheel. */
+static void
+link_thread(register struct timer_wheel* const wheel,
+            const int thread_index)
+{
+ register const long wakeup_time=thread_table[thread_index].data.wakeup_time;
+ register long       delta=wakeup_time-wheel->time;
+ register long       slot_time=wakeup_time;
+ register int        level=0;
+ register int        slot;
+
+ /* Threads which are due, which only happens when a slot is cascaded, are
+    put in the current slot on level 0. It is processed right after the
+    cascade. */
+ if (delta <= 0)
+ {
+  delta=0;
+  slot_time=wheel->time;
+ }
+
+ while((level < TIMER_WHEEL_LEVELS-1) &&
+       (delta >= (1L<<(TIMER_WHEEL_SLOT_BITS*(level+1)))))
+  level++;
+
+ /* Wake up times beyond the reach of the top level are parked in its last
+    reachable slot. They are put back in the right place when cascaded. */
+ if (delta >= (1L<<(TIMER_WHEEL_SLOT_BITS*TIMER_WHEEL_LEVELS)))
+  slot_time=wheel->time+(1L<<(TIMER_WHEEL_SLOT_BITS*TIMER_WHEEL_LEVELS))-1;
+
+ slot=(slot_time>>(TIMER_WHEEL_SLOT_BITS*level)) & (TIMER_WHEEL_SLOTS-1);
+
+ thread_table[thread_index].data.timer_slot=level*TIMER_WHEEL_SLOTS+slot;
+ thread_table[thread_index].data.timer_previous=-1;
+ thread_table[thread_index].data.timer_next=wheel->slots[level][slot];
+ if (-1 != wheel->slots[level][slot])
+  thread_table[wheel->slots[level][slot]].data.timer_previous=thread_index;
+ wheel->slots[level][slot]=thread_index;
+ wheel->bitmap[level]|=1UL<<slot;
+}
+
+/*! Unlinks a thread from its slot. The caller must hold the lock of the
+    wheel. */
+static void
+unlink_thread(register struct timer_wheel* const wheel,
+              const int thread_index)
+{
+ register const int level=
+  thread_table[thread_index].data.timer_slot/TIMER_WHEEL_SLOTS;
+ register const int slot=
+  thread_table[thread_index].data.timer_slot%TIMER_WHEEL_SLOTS;
+ register const int previous=thread_table[thread_index].data.timer_previous;
+ register const int next=thread_table[thread_index].data.timer_next;
+
+ if (-1 == previous)
+  wheel->slots[level][slot]=next;
+ else
+  thread_table[previous].data.timer_next=next;
+
+ if (-1 != next)
+  thread_table[next].data.timer_previous=previous;
+
+ if (-1 == wheel->slots[level][slot])
+  wheel->bitmap[level]&=~(1UL<<slot);
+
+ thread_table[thread_index].data.timer_slot=-1;
+}
+
+/*! Picks the wake up time to use for a thread with slack.
+    \returns The time from earliest to latest which has the most trailing
+             zero bits. */
+static long
+coalesce_wakeup_time(const long earliest, const long latest)
+{
+ register unsigned long highest_differing_bit;
+
+ if (latest <= earliest)
+  return earliest;
+
+ /* All times from earliest to latest share the bits above the highest bit
+    that differs between earliest-1 and latest. That bit is set in latest, so
+    clearing the bits below it gives a time in the range. */
+ __asm("bsrq %1,%0" : "=r" (highest_differing_bit) :
+       "r" ((earliest-1) ^ latest) : "cc");
+
+ return latest & ~((1L<<highest_differing_bit)-1);
+}
+
+void
+timer_wheel_insert(const int thread_index, unsigned long timer_ticks)
+{
+ timer_wheel_insert_absolute(thread_index, system_time+timer_ticks, 0);
+}
+
+void
+timer_wheel_insert_absolute(const int  thread_index,
+                            const long wakeup_time,
+                            const long slack)
+{
+ register const int                CPU_index=get_processor_index();
+ register struct timer_wheel* const wheel=&timer_wheels[CPU_index];
+
+ grab_lock_rw(&wheel->lock);
+
+ /* An idle wheel may lag behind. Nothing is due in it so it can simply be
+    moved forward. */
+ if (wheel_is_empty(wheel))
+  wheel->time=system_time;
+
+ thread_table[thread_index].data.wakeup_time=
+  coalesce_wakeup_time(wakeup_time, wakeup_time+slack);
+ thread_table[thread_index].data.timer_CPU=CPU_index;
+ link_thread(wheel, thread_index);
+ release_lock(&wheel->lock);
+}
+
+void
+timer_wheel_arm_timeout(const int     thread_index,
+                        unsigned long timer_ticks,
+                        const int     timeout_object)
+{
+ thread_table[thread_index].data.timeout_object=timeout_object;
+ thread_table[thread_index].data.timeout_state=TIMEOUT_ARMED;
+ timer_wheel_insert(thread_index, timer_ticks);
+}
+
+int
+timer_wheel_claim_waiter(const int thread_index)
+{
+ if (TIMEOUT_NONE == thread_table[thread_index].data.timeout_state)
+  return 1;
+
+ if (TIMEOUT_ARMED != lock_cmpxchg(&thread_table[thread_index].data.
+                                    timeout_state,
+                                   TIMEOUT_ARMED, TIMEOUT_WOKEN))
+  return 0;
+
+ /* The thread may already have been taken out of the wheel by a tick that
+    lost the race. Then the tick has dropped it. */
+ timer_wheel_cancel(thread_index);
+ thread_table[thread_index].data.timeout_state=TIMEOUT_NONE;
+ return 1;
+}
+
+int
+timer_wheel_cancel(const int thread_index)
+{
+ register const int CPU_index=thread_table[thread_index].data.timer_CPU;
+ register struct timer_wheel* const wheel=&timer_wheels[CPU_index];
+ register int was_linked=0;
+
+ grab_lock_rw(&wheel->lock);
+ if (-1 != thread_table[thread_index].data.timer_slot)
+ {
+  unlink_thread(wheel, thread_index);
+  was_linked=1;
+ }
+ release_lock(&wheel->lock);
+
+ return was_linked;
+}
+
+/*! Moves all threads in a slot down to the levels below. The caller must
+    hold the lock of the wheel. */
+static void
+cascade_slot(register struct timer_wheel* const wheel,
+             const int level,
+             const int slot)
+{
+ register int thread_index=wheel->slots[level][slot];
+
+ wheel->slots[level][slot]=-1;
+ wheel->bitmap[level]&=~(1UL<<slot);
+
+ while(-1 != thread_index)
+ {
+  register const int next=thread_table[thread_index].data.timer_next;
+  link_thread(wheel, thread_index);
+  thread_index=next;
+ }
+}
+
+/*! Advances a wheel one clock tick and moves the threads which are due to a
+    list linked through timer_next. The next member cannot be used for the
+    list as a thread blocked with a timeout is still linked into the queue
+    of its wait object. The caller must hold the lock of the wheel. */
+static void
+advance_wheel(register struct timer_wheel* const wheel,
+              int* const expired_head,
+              int* const expired_tail)
+{
+ register int thread_index;
+ register int level;
+ register int slot;
+
+ wheel->time++;
+
+ /* Cascade the higher levels whose current slot starts now. */
+ for(level=1; level<TIMER_WHEEL_LEVELS; level++)
+ {
+  if (0 != (wheel->time & ((1L<<(TIMER_WHEEL_SLOT_BITS*level))-1)))
+   break;
+
+  slot=(wheel->time>>(TIMER_WHEEL_SLOT_BITS*level)) & (TIMER_WHEEL_SLOTS-1);
+  if (0 != (wheel->bitmap[level] & (1UL<<slot)))
+   cascade_slot(wheel, level, slot);
+ }
+
+ /* Collect the threads that are due. Parked threads with a later wake up
+    time are linked back in. */
+ slot=wheel->time & (TIMER_WHEEL_SLOTS-1);
+ if (0 == (wheel->bitmap[0] & (1UL<<slot)))
+  return;
+
+ thread_index=wheel->slots[0][slot];
+ wheel->slots[0][slot]=-1;
+ wheel->bitmap[0]&=~(1UL<<slot);
+
+ while(-1 != thread_index)
+ {
+  register const int next=thread_table[thread_index].data.timer_next;
+
+  if (thread_table[thread_index].data.wakeup_time <= wheel->time)
+  {
+   thread_table[thread_index].data.timer_slot=-1;
+
+   /* A thread blocked with a timeout is only expired if the timeout wins
+      the race against the wake up. */
+   if ((TIMEOUT_NONE == thread_table[thread_index].data.timeout_state) ||
+       (TIMEOUT_ARMED == lock_cmpxchg(&thread_table[thread_index].data.
+                                       timeout_state,
+                                      TIMEOUT_ARMED, TIMEOUT_EXPIRED)))
+   {
+    thread_table[thread_index].data.timer_next=-1;
+    if (-1 == *expired_tail)
+     *expired_head=thread_index;
+    else
+     thread_table[*expired_tail].data.timer_next=thread_index;
+    *expired_tail=thread_index;
+   }
+  }
+  else
+   link_thread(wheel, thread_index);
+
+  thread_index=next;
+ }
+}
+
+void
+timer_wheel_tick(void)
+{
+ register struct timer_wheel* const wheel=
+  &timer_wheels[get_processor_index()];
+ int          expired_head=-1;
+ int          expired_tail=-1;
+ register int thread_index;
+
+ grab_lock_rw(&wheel->lock);
+
+ /* The local timers of the CPUs are not in phase with the system time and
+    an idle CPU may not have ticked for a while. Catch up with the system
+    time. */
+ while(wheel->time < system_time)
+ {
+  if (wheel_is_empty(wheel))
+  {
+   wheel->time=system_time;
+   break;
+  }
+
+  advance_wheel(wheel, &expired_head, &expired_tail);
+ }
+
+ release_lock(&wheel->lock);
+
+ /* Make the threads ready without holding the lock. They last ran on this
+    CPU so they are normally woken up here. */
+ while(-1 != (thread_index=expired_head))
+ {
+  expired_head=thread_table[thread_index].data.timer_next;
+
+  if (TIMEOUT_EXPIRED == thread_table[thread_index].data.timeout_state)
+   timeout_expired(thread_index);
+  else
+   make_thread_ready(thread_index);
+ }
+}
+
+long
+timer_wheel_ticks_until_next_expiry(void)
+{
+ register const struct timer_wheel* const wheel=
+  &timer_wheels[get_processor_index()];
+ register int level;
+
+ /* The wheel is read without the lock. Only the CPU itself inserts threads
+    and a cancelled thread at worst makes the CPU wake up needlessly. */
+ if (0 != wheel->bitmap[0])
+ {
+  register const int current_slot=wheel->time & (TIMER_WHEEL_SLOTS-1);
+  register int       i;
+
+  for(i=1; i<=TIMER_WHEEL_SLOTS; i++)
+  {
+   if (0 != (wheel->bitmap[0] &
+             (1UL<<((current_slot+i) & (TIMER_WHEEL_SLOTS-1)))))
+    return (wheel->time+i)-system_time;
+  }
+ }
+
+ /* Nothing is due within the range of level 0. Wake up when the lowest
+    non-empty level is cascaded next and look again. */
+ for(level=1; level<TIMER_WHEEL_LEVELS; level++)
+ {
+  if (0 != wheel->bitmap[level])
+  {
+   register const long span=1L<<(TIMER_WHEEL_SLOT_BITS*level);
+   return ((wheel->time+span) & ~(span-1))-system_time;
+  }
+ }
+
+ return -1;
+}
@@ -0,0 +1,95 @@
+/*! \file timer.h
+    \brief Holds declarations for the timer wheel. */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include "kernel.h"
+
+#define TIMER_WHEEL_LEVELS      (4)
+/*!< The number of levels in the timer wheel. */
+#define TIMER_WHEEL_SLOT_BITS   (6)
+/*!< The number of bits of the wake up time used to index the slots of each
+     level. */
+#define TIMER_WHEEL_SLOTS       (1<<TIMER_WHEEL_SLOT_BITS)
+/*!< The number of slots in each level of the timer wheel. The number must
+     not be larger than the number of bits in the slot bitmaps. */
+
+/*! Initializes the timer wheels of all CPUs to be empty. */
+extern void
+initialize_timer_wheels(void);
+
+/*! Inserts a thread into the timer wheel of the calling CPU. The thread is
+    made ready by timer_wheel_tick, on the calling CPU, when the given
+    number of clock ticks have passed. */
+extern void
+timer_wheel_insert(const int     thread_index
+                    /*!< The index, into thread_table, of the thread. */,
+                   unsigned long timer_ticks
+                    /*!< The number of clock ticks to wait. Must not be 0. */);
+
+/*! Removes a thread from the timer wheel it is in. May be called from any
+    CPU. Threads blocked with a timeout must be removed with
+    timer_wheel_claim_waiter instead.
+    \returns 1 if the thread was in a timer wheel and 0 otherwise. */
+extern int
+timer_wheel_cancel(const int thread_index
+                    /*!< The index, into thread_table, of the thread. */);
+
+/*! Inserts a thread into the timer wheel of the calling CPU. The thread is
+    made ready at a system time from wakeup_time up to wakeup_time plus
+    slack. The time is chosen so that nearby wake ups with slack fall on the
+    same clock tick. */
+extern void
+timer_wheel_insert_absolute(const int     thread_index
+                             /*!< The index, into thread_table, of the
+                                  thread. */,
+                            const long    wakeup_time
+                             /*!< The earliest system time to make the
+                                  thread ready at. Must be later than the
+                                  system time. */,
+                            const long    slack
+                             /*!< The number of clock ticks the thread may
+                                  be made ready late. */);
+
+/*! Blocks a thread with a timeout. The thread is inserted into the timer
+    wheel of the calling CPU and must also be put on the wait object it is
+    blocked on. The caller must hold the lock of the wait object so that the
+    thread cannot be woken before it is in the timer wheel. */
+extern void
+timer_wheel_arm_timeout(const int     thread_index
+                         /*!< The index, into thread_table, of the
+                              thread. */,
+                        unsigned long timer_ticks
+                         /*!< The number of clock ticks to wait. Must not
+                              be 0. */,
+                        const int     timeout_object
+                         /*!< The handle of the port the thread receives on
+                              or TIMEOUT_OBJECT_KEYBOARD. */);
+
+/*! Claims a thread taken from a wait object for waking it up. A thread
+    blocked with a timeout is removed from its timer wheel. The caller must
+    hold the lock of the wait object.
+    \returns 1 if the caller may wake up the thread. Returns 0 if the timeout
+             has already won. The thread must then be left to
+             timeout_expired. */
+extern int
+timer_wheel_claim_waiter(const int thread_index
+                          /*!< The index, into thread_table, of the
+                               thread. */);
+
+/*! Advances the timer wheel of the calling CPU to the system time and makes
+    all threads whose wake up time has been reached ready. Called at every
+    clock tick on every CPU. */
+extern void
+timer_wheel_tick(void);
+
+/*! Calculates when an idle CPU has to tick next to serve its timer wheel.
+    \returns The number of clock ticks, counted from the system time, until
+             the timer wheel of the calling CPU may have a thread to wake up.
+             The value is never later than the first wake up time. Returns
+             -1 if the wheel is empty. */
+extern long
+timer_wheel_ticks_until_next_expiry(void);
+
+#endif